@@ -1,25 +1,149 @@
 #include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <err.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD	1
+#endif
 
-#include "js0n.h"
-#include "j0g.h"
-#include "htmlescape.h"
 #include "queue.h"
 #include "vec.h"
 
 #include "cmustache.h"
 
 #define BUFSZ_DELTA	10240
+#define ARENA_BLKSZ	16384
 #define DOT			'.'
 
+		/*
+		 * A file descriptor sink batches up to SINK_IOV_N spans
+		 * per writev().  Everything it sends (template text, JSON
+		 * values and entities) outlives the render, so nothing
+		 * is copied.
+		 */
+
+#define SINK_IOV_N	256
+
+		/*
+		 * A list is only split across threads if every
+		 * thread gets at least this many elements.
+		 */
+
+#define PAR_MIN_ELEMENTS	256
+
+		/*
+		 * An object with at least WIDE_OBJECT members gets a
+		 * hash index for its keys once it has been searched
+		 * WIDE_SEARCHES times in a render.
+		 */
+
+#define WIDE_OBJECT		32
+#define WIDE_SEARCHES	4
+
+enum sinktype {
+	buf_sink,
+	callback_sink,
+	fd_sink,
+	count_sink,
+	mem_sink
+};
+
+// Where rendered output goes.
+// A count sink only adds up len; a memory sink fills the size
+// bytes at mem, len being how many it has used.
+struct sink {
+	enum sinktype	type;
+	struct buf	*buf;
+	sink_write_fn	write;
+	void		*arg;
+	int		fd;
+	struct iovec	iov[SINK_IOV_N];
+	int		iov_n;
+	char		*mem;
+	size_t		size;
+	size_t		len;
+};
+
+// A compile in progress: the program and the sections open in it,
+// shared by the template and every partial inlined into it.
+struct compiler {
+	struct program	*prog;
+	size_t		names[MAX_SECTION_DEPTH];
+	int		path[MAX_SECTION_DEPTH];
+	int		sections_n;
+	int		base;		// sections open outside this partial
+	struct interntab paths;
+	struct interntab slots;
+	partial_fn	load;
+	void		*arg;
+	const char	*inlining[MAX_PARTIAL_DEPTH];	// partials being inlined
+	int		inlining_n;
+	int		calls;		// op_calls added
+};
+
+// A walk through the structural characters found by
+// index_structure(), for parsedoc().
+struct tokens {
+	const struct jsonstruct *s;
+	size_t		w;		// the word of s->bits being read
+	uint64_t	m;		// what is left of it
+	size_t		pos;		// the next one, or end if none
+	size_t		end;
+};
+
+// A slice of a list's elements, rendered on its own thread.
+struct chunk {
+	struct exec	*parent;
+	size_t		lo;
+	size_t		hi;
+	size_t		first;		// the tape entry of element lo
+	size_t		close;		// op that ends the list's body
+	struct buf	b;
+	int		rval;
+	int		started;
+	pthread_t	tid;
+	SLIST_ENTRY(chunk) link;
+};
+
+// A call of a recursive partial, to be returned from.
+struct call {
+	size_t		ret;		// the op_call
+	unsigned long	stamp;		// the caller's
+};
+
+// Everything one render (or one chunk of one) works with.
+struct exec {
+	const struct program *prog;
+	struct sink	*out;
+	struct arena	arena;
+	struct memo	*memo;
+	struct objcache	objs;
+	struct jsonval	ctx[MAX_SECTION_DEPTH + 1];
+	struct frame	frame[MAX_SECTION_DEPTH + 1];
+	struct call	calls[MAX_PARTIAL_DEPTH];
+	int		calls_n;
+	unsigned long	clock;
+	int		sections_n;
+	int		threads;
+	scan_fn		find_special;	// picked once per render
+	SLIST_HEAD(, chunk) held;
+};
+
 
 		/*
 		 * Add -DDEUG to CFLAGS in Makefile to turn on debug output.
@@ -35,20 +159,151 @@
                                 __LINE__, __func__, __VA_ARGS__); } while (0)
 
 
-// The js0n library scans the json string
-// and records the (offset, length) pair for each key and each value
-// found in the json string.
+// Hand out n zeroed bytes from the arena, starting a new block
+// when the current one is full.  Blocks grow geometrically, and one
+// request too big for a standard block gets a block of its own.
+//
+// With no arena it is just calloc(), so that code which builds a
+// tree outside a render can still free it piece by piece.
+//
+// Returns NULL if memory runs out.
+void *
+arena_alloc(struct arena *a, size_t n)
+{
+	struct arenablk	*b;
+	size_t		sz;
+
+	if (!a)
+		return calloc(1, n ? n : 1);
+
+	// Keep every allocation aligned for any type.
+	n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+	b = a->head;
+	if (!b || b->sz - b->used < n) {
+		sz = b ? b->sz * 2 : ARENA_BLKSZ;
+		if (sz < n)
+			sz = n;
+		if (sz > SIZE_MAX - sizeof(*b))
+			return NULL;
+		if ((b = malloc(sizeof(*b) + sz)) == NULL)
+			return NULL;
+		b->sz = sz;
+		b->used = 0;
+		b->next = a->head;
+		a->head = b;
+		a->blocks++;
+	}
+
+	b->used += n;
+	a->allocs++;
+
+	return memset((char *) b->data + b->used - n, 0, n);
+}
+
+// Release everything handed out by an arena, but keep its memory
+// for the next round.  If the last round needed more than one block,
+// they are replaced by a single block big enough for all of it,
+// so an arena reused for similar work soon stops calling malloc().
+void
+arena_reset(struct arena *a)
+{
+	struct arenablk	*b;
+	size_t		sz = 0;
+
+	if (!a || !a->head)
+		return;
+
+	if (!a->head->next) {
+		a->head->used = 0;
+		return;
+	}
+
+	for (b = a->head; b; b = b->next)
+		sz += b->sz;
+
+	arena_free(a);
+
+	if ((b = malloc(sizeof(*b) + sz)) != NULL) {
+		b->sz = sz;
+		b->used = 0;
+		b->next = 0;
+		a->head = b;
+		a->blocks++;
+	}
+}
+
+// Release everything handed out by an arena in one step.
+// The arena can be used again afterwards.
+void
+arena_free(struct arena *a)
+{
+	struct arenablk	*b;
+
+	while (a && (b = a->head) != NULL) {
+		a->head = b->next;
+		free(b);
+	}
+}
+
+// Read entry i of a JSON index.
+size_t
+index_at(const struct jsonindex *ix, size_t i)
+{
+	switch (ix->width) {
+	case 2:
+		return ((const uint16_t *) ix->v)[i];
+	case 4:
+		return ((const uint32_t *) ix->v)[i];
+	default:
+		return ((const uint64_t *) ix->v)[i];
+	}
+}
+
+void
+index_set(struct jsonindex *ix, size_t i, size_t val)
+{
+	switch (ix->width) {
+	case 2:
+		((uint16_t *) ix->v)[i] = (uint16_t) val;
+		break;
+	case 4:
+		((uint32_t *) ix->v)[i] = (uint32_t) val;
+		break;
+	default:
+		((uint64_t *) ix->v)[i] = (uint64_t) val;
+		break;
+	}
+}
+
+void
+free_index(struct jsonindex *ix)
+{
+	if (ix) {
+		if (!ix->arena)
+			free(ix->v);
+		ix->v = 0;
+		ix->sz = 0;
+	}
+}
+
+// The index records the (offset, length) pair for each key and each value
+// found at the top level of a json string.
+//
+// This routine calculates the number of entries (ix->sz) required
+// for the given json string, picks the narrowest entry width that can
+// hold any offset in it, and allocates the storage array (ix->v).
+// Documents under 64 KB get two-byte entries, as they always have;
+// bigger ones get four, and bigger than 4 GB get eight.
 //
-// This routine calculates the size of the array (\*iszp) required
-// for the given a json string
-// and allocates a storage array of unsigned shorts (\*\*indexp).
+// The storage comes from ix->arena if it is set.
 //
 // If the memory allocation fails, it returns ENOMEM.
 // 
-// If the required length overflows an unsigned int, 
+// If the required length overflows a size_t, 
 // it returns EX_TOO_MANY_KEYVAL_PAIRS.
 int
-size_index(const char *json, size_t jsonlen, unsigned short **indexp, unsigned int *iszp)
+size_index(const char *json, size_t jsonlen, struct jsonindex *ix)
 {
 	const char	*p;
 	int		rval = 0;
@@ -58,42 +313,37 @@ size_index(const char *json, size_t jsonlen, unsigned short **indexp, unsigned i
 		 * (one key + one value) x (one offset + one length) = 4
 		 */
 
-	unsigned int entries_per_comma = 4;
+	size_t entries_per_comma = 4;
 
 		/*
-		 * We need at least one extra slot (js0n zero-terminates
-		 * the array) plus four for the last key/value pair.
+		 * We need at least one extra slot (the index is
+		 * zero-terminated) plus four for the last key/value pair.
 		 * Add some more for safety ...
 		 */
 
-	unsigned int extra = 21;
+	size_t extra = 21;
 
 		/*
 		 * The number of commas in JSON is an upper limit
 		 * on the number of key/value pairs - 1.
-		 * 
-		 * Note: On my macbook pro, it takes 8.62 seconds to count
-		 * to UINT_MAX by one's.  Probably could use a lower limit.
 		 */
 
-	for (p = json; !rval && p - json < jsonlen; p++) {
+	for (p = json; p - json < jsonlen; p++)
 		n += (*p == ',');
-		if (n >= UINT_MAX)
-			rval = EX_TOO_MANY_KEYVAL_PAIRS;
-	}
-		/*
-		 * The array holds short ints, but the array index
-		 * is an unsigned int, so we check against UINT_MAX.
-		 */
 
-	if (!rval && n > UINT_MAX / entries_per_comma - extra)
+	if (jsonlen <= UINT16_MAX)
+		ix->width = 2;
+	else if (jsonlen <= UINT32_MAX)
+		ix->width = 4;
+	else
+		ix->width = 8;
+
+	if (n > (SIZE_MAX / ix->width - extra) / entries_per_comma)
 		rval = EX_TOO_MANY_KEYVAL_PAIRS;
 
 	if (!rval) {
-		*iszp = (unsigned int) n;
-		*iszp *= entries_per_comma;
-		*iszp += extra;
-		if ((*indexp = calloc(*iszp, sizeof(unsigned int))) == NULL)
+		ix->sz = n * entries_per_comma + extra;
+		if ((ix->v = arena_alloc(ix->arena, ix->sz * ix->width)) == NULL)
 			rval = ENOMEM;
 	}
 
@@ -101,7 +351,144 @@ size_index(const char *json, size_t jsonlen, unsigned short **indexp, unsigned i
 
 }
 
+// Skip whitespace, returning the offset of the next non-blank byte.
+size_t
+skipws(const char *json, size_t i, size_t jsonlen)
+{
+	while (i < jsonlen && isspace((unsigned char) json[i]))
+		i++;
+	return i;
+}
+
+// Find the end of the value that starts at json[i].
+//
+// Strings are reported without their quotes (\*vs is just past
+// the opening quote, \*ve is the closing quote),
+// objects and arrays with their brackets,
+// and anything else up to the next delimiter.
+int
+scan_value(const char *json, size_t i, size_t jsonlen, size_t *vs, size_t *ve)
+{
+	size_t		j = i;
+	size_t		depth = 0;
+	int		instring = 0;
+
+	if (i >= jsonlen)
+		return EX_JSON_PARSE_ERROR;
+
+	switch (json[i]) {
+
+	case '"':
+		for (j = i + 1; j < jsonlen && json[j] != '"'; j++)
+			if (json[j] == '\\')
+				j++;
+		if (j >= jsonlen)
+			return EX_JSON_PARSE_ERROR;
+		*vs = i + 1;
+		*ve = j;
+		return 0;
+
+	case '{':
+	case '[':
+		for (j = i; j < jsonlen; j++) {
+			if (instring) {
+				if (json[j] == '\\')
+					j++;
+				else if (json[j] == '"')
+					instring = 0;
+			}
+			else if (json[j] == '"')
+				instring = 1;
+			else if (json[j] == '{' || json[j] == '[')
+				depth++;
+			else if ((json[j] == '}' || json[j] == ']') && --depth == 0)
+				break;
+		}
+		if (j >= jsonlen)
+			return EX_JSON_PARSE_ERROR;
+		*vs = i;
+		*ve = j + 1;
+		return 0;
+
+	default:
+		while (j < jsonlen && json[j] != ',' && json[j] != '}'
+				&& json[j] != ']' && !isspace((unsigned char) json[j]))
+			j++;
+		if (j == i)
+			return EX_JSON_PARSE_ERROR;
+		*vs = i;
+		*ve = j;
+		return 0;
+	}
+}
+
+// Load the (offset, length) pairs for the top-level keys and values
+// of an object, or the values of an array, into the index.
+//
+// This produces what js0n did, but with offsets as wide as
+// the index needs.
+int
+scan_json(const char *json, size_t jsonlen, struct jsonindex *ix)
+{
+	size_t		i = 0;
+	size_t		n = 0;
+	size_t		vs = 0;
+	size_t		ve = 0;
+	int		isobj = 0;
+	int		rval = 0;
+
+	i = skipws(json, 0, jsonlen);
+	if (i >= jsonlen)
+		return rval;
+
+	if (json[i] != '{' && json[i] != '[')
+		return EX_JSON_PARSE_ERROR;
+
+	isobj = json[i++] == '{';
+
+	while (!rval) {
+
+		i = skipws(json, i, jsonlen);
+		if (i < jsonlen && (json[i] == '}' || json[i] == ']'))
+			break;
+
+		if (isobj) {
+			if (i >= jsonlen || json[i] != '"')
+				rval = EX_JSON_PARSE_ERROR;
+			if (!rval)
+				rval = scan_value(json, i, jsonlen, &vs, &ve);
+			if (!rval && n + 2 >= ix->sz)
+				rval = EX_TOO_MANY_KEYVAL_PAIRS;
+			if (!rval) {
+				index_set(ix, n++, vs);
+				index_set(ix, n++, ve - vs);
+				i = skipws(json, ve + 1, jsonlen);
+				if (i >= jsonlen || json[i] != ':')
+					rval = EX_JSON_PARSE_ERROR;
+				i = skipws(json, i + 1, jsonlen);
+			}
+		}
+
+		if (!rval)
+			rval = scan_value(json, i, jsonlen, &vs, &ve);
+		if (!rval && n + 2 >= ix->sz)
+			rval = EX_TOO_MANY_KEYVAL_PAIRS;
+		if (!rval) {
+			index_set(ix, n++, vs);
+			index_set(ix, n++, ve - vs);
+			i = skipws(json, ve + (json[i] == '"'), jsonlen);
+			if (i < jsonlen && json[i] == ',')
+				i++;
+			else if (i >= jsonlen || (json[i] != '}' && json[i] != ']'))
+				rval = EX_JSON_PARSE_ERROR;
+		}
+	}
+
+	if (!rval)
+		index_set(ix, n, 0);
 
+	return rval;
+}
 
 // Allocate and load the set of offset and length pairs
 // for the key/values in the given JSON.  Zero-terminate
@@ -110,34 +497,62 @@ size_index(const char *json, size_t jsonlen, unsigned short **indexp, unsigned i
 // Returns 0 on success, 
 // EX_JSON_PARSE_ERROR if there was an error parsing JSON.
 int
-index_json(const char *json, size_t jsonlen, unsigned short **indexp)
+index_json(const char *json, size_t jsonlen, struct jsonindex *ix)
 {
 	int		rval = 0;
-	unsigned int	isz;
 
-	if (!json || !strlen(json) || !indexp)
+	ix->v = 0;
+	ix->sz = 0;
+	ix->width = 2;
+
+	if (!json || !jsonlen)
 		return rval;
 
-	rval = size_index(json, jsonlen, indexp, &isz);
+	rval = size_index(json, jsonlen, ix);
 
-	if (!rval) {
+	if (!rval)
+		rval = scan_json(json, jsonlen, ix);
 
-		rval = js0n((const unsigned char *) json, jsonlen, *indexp, isz);
+	if (rval)
+		free_index(ix);
 
-		if (rval)
+	return rval;
 
-			rval = EX_JSON_PARSE_ERROR;
-	}
+}
 
-	return rval;
+// Find key in an index of an object.
+//
+// Returns the position in the index of the key's value offset,
+// or 0 if the key is not there.
+size_t
+index_find(const char *json, const struct jsonindex *ix, const char *key, size_t keylen)
+{
+	size_t		offset = 0;
+
+	if (!ix->v)
+		return 0;
+
+	for (size_t i = 0; (offset = index_at(ix, i)) != 0; i += 4)
+		if (index_at(ix, i + 1) == keylen && !memcmp(json + offset, key, keylen))
+			return i + 2;
 
+	return 0;
 }
 
 enum jsontype
-valtotype(const char *json, unsigned short offset, unsigned short length)
+valtotype(const char *json, size_t offset, size_t length)
 {
 	const char *p;
 
+		/*
+		 * The index strips the quotes off string values, so
+		 * a string like "false" or "{x}" is spotted
+		 * by the quote just before it.
+		 */
+
+	if (offset > 0 && json[offset - 1] == '"')
+		return string_type;
+
 	for (p = json + offset; isspace(*p) && p - json - offset < length; p++)
 		/* EMPTY */
 		;
@@ -163,189 +578,753 @@ valtotype(const char *json, unsigned short offset, unsigned short length)
 }
 
 
-int
-parsejsonarray(const char *json, size_t jsonlen, struct json *jp)
+		/*
+		 * Finding the structure of a JSON text.
+		 *
+		 * parsedoc() works in two stages, after simdjson.
+		 * The first classifies the text 64 bytes at a time into
+		 * bitmaps of quotes, backslashes and brackets, colons and
+		 * commas, with 16 (SSE2) or 32 (AVX2) byte compares where
+		 * the CPU has them, and from those works out which quotes
+		 * are escaped and which bytes are inside strings, leaving
+		 * one bit for every structural character.  The second
+		 * builds the tape by walking from one set bit to the next,
+		 * so it never looks at the bytes of a string or at
+		 * anything between tokens but a little whitespace.
+		 *
+		 * '{' and '[' differ only in bit 5, as do '}' and ']',
+		 * so (c | 0x20) == '{' finds both opening brackets.
+		 */
+
+void
+classify_scalar(const char *p, struct jsonmasks *m)
 {
-	struct jsonpair *p;
-	unsigned short	*index = 0;
-	int rval = 0;
+	uint64_t	bit = 1;
+
+	memset(m, 0, sizeof(*m));
+
+	for (int i = 0; i < 64; i++, bit <<= 1) {
+		switch (p[i]) {
+		case '"':
+			m->quote |= bit;
+			break;
+		case '\\':
+			m->bslash |= bit;
+			break;
+		case '{': /* FALLTHROUGH */
+		case '[': /* FALLTHROUGH */
+		case ',':
+			m->open |= bit;
+			break;
+		case '}': /* FALLTHROUGH */
+		case ']': /* FALLTHROUGH */
+		case ':':
+			m->close |= bit;
+			break;
+		}
+	}
+}
 
-printf("parsejsonarray: %.10s\n", json);
+#ifdef HAVE_X86_SIMD
 
-	SLIST_INIT(jp);
+__attribute__((target("sse2")))
+void
+classify_sse2(const char *p, struct jsonmasks *m)
+{
+	const __m128i	bit5 = _mm_set1_epi8(0x20);
+	__m128i		v, v5;
+
+	memset(m, 0, sizeof(*m));
+
+	for (int i = 0; i < 64; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (p + i));
+		v5 = _mm_or_si128(v, bit5);
+		m->quote |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+		m->bslash |= (uint64_t) (uint16_t) _mm_movemask_epi8(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+		m->open |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v5, _mm_set1_epi8('{')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(',')))) << i;
+		m->close |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v5, _mm_set1_epi8('}')),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(':')))) << i;
+	}
+}
 
-	rval = index_json(json, jsonlen, &index);
+__attribute__((target("avx2")))
+void
+classify_avx2(const char *p, struct jsonmasks *m)
+{
+	const __m256i	bit5 = _mm256_set1_epi8(0x20);
+	__m256i		v, v5;
+
+	memset(m, 0, sizeof(*m));
+
+	for (int i = 0; i < 64; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (p + i));
+		v5 = _mm256_or_si256(v, bit5);
+		m->quote |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+		m->bslash |= (uint64_t) (uint32_t) _mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+		m->open |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v5, _mm256_set1_epi8('{')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(',')))) << i;
+		m->close |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v5, _mm256_set1_epi8('}')),
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')))) << i;
+	}
+}
 
-	for (size_t i = 0; !rval && index[i]; i += 2) {
-		p = calloc(1, sizeof(*p));
-		if (!p) {
-			rval = ENOMEM;
-			continue;
+#endif
+
+// Pick the widest classifier this CPU can run.
+classify_fn
+classify_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return classify_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return classify_sse2;
+#endif
+	return classify_scalar;
+}
+
+// Bit i is set in the result for each byte after an odd-length run
+// of backslashes, given the backslashes in a block and whether the
+// last one escaped the first byte of this one (\*carry), which is
+// updated for the next.
+//
+// Backslashes are rare in contexts, so they are done one at a time.
+uint64_t
+escaped_mask(uint64_t bslash, int *carry)
+{
+	uint64_t	esc = 0;
+	int		k = 0;
+
+	if (*carry) {
+		esc = 1;
+		bslash &= ~(uint64_t) 1;
+	}
+	*carry = 0;
+
+	while (bslash) {
+		k = __builtin_ctzll(bslash);
+		if (k == 63) {
+			*carry = 1;
+			break;
 		}
-		SLIST_INIT(&p->children);
-		p->valoffset = index[i + 1];
-		p->vallength = index[i + 2];
-		p->type = valtotype(json, p->valoffset, p->vallength);
-		SLIST_INSERT_HEAD(jp, p, link);
-		
-		if (p->type == object_type)
-			parsejson(json + p->valoffset, p->vallength, &p->children);
-		else if (p->type == array_type)
-			parsejsonarray(json + p->valoffset, p->vallength, &p->children);
+		esc |= (uint64_t) 1 << (k + 1);
+		bslash &= ~(((uint64_t) 2 << (k + 1)) - 1);
 	}
 
-	free(index);
-	index = 0;
-	
-	return rval;
+	return esc;
 }
 
+// Bit i of the result is the parity of bits 0 through i of x:
+// set from each opening quote up to (not including) its closing one.
+uint64_t
+prefix_xor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+
+	return x;
+}
 
+// Stage one: set s->bits for the structural characters of json,
+// and count the opening brackets and commas among them in s->seps.
+//
+// The bitmap (a bit per byte of json) comes from the arena if one
+// is given, or from malloc().
+//
+// Returns EX_JSON_PARSE_ERROR if a string is not closed.
 int
-parsejson(const char *json, size_t jsonlen, struct json *jp)
+index_structure(const char *json, size_t jsonlen, struct arena *arena, struct jsonstruct *s)
 {
-	struct jsonpair *p;
-	unsigned short	*index = 0;
-	int rval = 0;
+	classify_fn	classify = classify_kernel();
+	struct jsonmasks m = {0};
+	char		tail[64];
+	uint64_t	esc = 0;
+	uint64_t	quote = 0;
+	uint64_t	inside = 0;
+	uint64_t	instring = 0;
+	int		carry = 0;
+	size_t		w = 0;
+
+	memset(s, 0, sizeof(*s));
+
+	s->words = (jsonlen + 63) / 64;
+	if (!s->words)
+		return 0;
 
-	SLIST_INIT(jp);
+	if ((s->bits = arena_alloc(arena, s->words * sizeof(*s->bits))) == NULL)
+		return ENOMEM;
 
-	rval = index_json(json, jsonlen, &index);
+	for (w = 0; w < s->words; w++) {
 
-	for (size_t i = 0; !rval && index[i]; i += 4) {
-		p = calloc(1, sizeof(*p));
-		if (!p) {
-			rval = ENOMEM;
-			continue;
+		if (jsonlen - w * 64 >= 64)
+			classify(json + w * 64, &m);
+		else {
+			memset(tail, ' ', sizeof(tail));
+			memcpy(tail, json + w * 64, jsonlen - w * 64);
+			classify(tail, &m);
 		}
-		SLIST_INIT(&p->children);
-		p->offset = index[i];
-		p->length = index[i + 1];
-		p->valoffset = index[i + 2];
-		p->vallength = index[i + 3];
-		p->type = valtotype(json, p->valoffset, p->vallength);
-		SLIST_INSERT_HEAD(jp, p, link);
-		
-		if (p->type == object_type)
-			parsejson(json + p->valoffset, p->vallength, &p->children);
-		else if (p->type == array_type)
-			parsejsonarray(json + p->valoffset, p->vallength, &p->children);
+
+		esc = escaped_mask(m.bslash, &carry);
+		quote = m.quote & ~esc;
+		inside = prefix_xor(quote) ^ instring;
+		instring = (uint64_t) ((int64_t) inside >> 63);
+
+		s->bits[w] = ((m.open | m.close) & ~inside) | quote;
+		s->seps += __builtin_popcountll(m.open & ~inside & ~quote);
 	}
 
-	free(index);
-	index = 0;
-	
-	return rval;
+	return instring ? EX_JSON_PARSE_ERROR : 0;
 }
 
-// Return 1 if the first non-whitespace character in json is a '{', 0 otherwise.
+// Step to the next structural character.
+void
+token_next(struct tokens *t)
+{
+	while (!t->m) {
+		if (++t->w >= t->s->words) {
+			t->pos = t->end;
+			return;
+		}
+		t->m = t->s->bits[t->w];
+	}
+
+	t->pos = t->w * 64 + __builtin_ctzll(t->m);
+	t->m &= t->m - 1;
+}
+
+// Whether the next structural character is c,
+// with nothing but whitespace from json[i] up to it.
 int
-is_obj(const char *json, size_t jsonlen) 
+token_is(const struct tokens *t, const char *json, size_t i, char c)
 {
-	const char	*p;
-	for (p = json; isspace(*p) && p - json < jsonlen; p++);
-	return *p == '{';
+	return t->pos < t->end && json[t->pos] == c && skipws(json, i, t->end) == t->pos;
 }
 
+// Step past the next structural character, which should be c,
+// and set \*i just past it.
+int
+token_expect(struct tokens *t, const char *json, size_t *i, char c)
+{
+	if (!token_is(t, json, *i, c))
+		return EX_JSON_PARSE_ERROR;
 
+	*i = t->pos + 1;
+	token_next(t);
 
+	return 0;
+}
 
-// Move the offset and length so
-// the character sequence they define
-// does not start or end with whitespace.
-void
-trim(const char *json, unsigned short *offset, unsigned short *length)
+// Step past the closing quote of a string that has just been
+// opened, and set \*ve to where it is.  Nothing inside a string
+// is structural, so it is the next structural character.
+int
+token_string(struct tokens *t, size_t *ve)
 {
-	if (!offset || !length || !json)
-		return;
+	if (t->pos >= t->end)
+		return EX_JSON_PARSE_ERROR;
 
-	while (isspace(*(json + *offset)) && *length > 0) {
-		(*offset)++;
-		(*length)--;
-	}
+	*ve = t->pos;
+	token_next(t);
 
-	while (isspace(*(json + *offset + *length - 1)) && *length > 0) {
-		(*length)--;
+	return 0;
+}
+
+// Stage two: add the value at json[i] to the tape, after everything
+// in it, and set \*end just past it.
+//
+// Strings are recorded without their quotes, objects and arrays
+// with their brackets, and anything else up to the next delimiter,
+// as scan_value() does.
+//
+// Nesting is followed without recursion, so deep JSON can't run
+// the C stack out.  Until an object or array is closed, its next[]
+// entry holds that of the one it is in, plus one (0 at the top);
+// the tape is its own stack.
+int
+tape_value(struct jsondoc *doc, struct tokens *t, size_t i, size_t *end)
+{
+	const char	*json = doc->json;
+	size_t		top = 0;	// the innermost open one, plus one
+	size_t		n = 0;
+	size_t		j = i;
+	size_t		ks = 0;
+	size_t		ke = 0;
+	size_t		vs = 0;
+	size_t		ve = 0;
+	char		close = 0;
+	int		opened = 0;
+	int		rval = 0;
+
+	for (;;) {
+
+		// A value at json[j], with its key (if any) at json[ks].
+		n = doc->n++;
+		doc->key[n] = ks;
+		doc->keylen[n] = ke - ks;
+		doc->members[n] = 0;
+		doc->next[n] = doc->n;
+		opened = 0;
+
+		if (j != t->pos) {
+
+			// A number, true, false or null.
+			rval = scan_value(json, j, t->end, &vs, &ve);
+			doc->type[n] = valtotype(json, vs, ve - vs);
+			doc->val[n] = vs;
+			doc->vallen[n] = ve - vs;
+			j = ve;
+
+		} else if (json[j] == '"') {
+
+			token_next(t);
+			rval = token_string(t, &ve);
+			doc->type[n] = string_type;
+			doc->val[n] = j + 1;
+			doc->vallen[n] = rval ? 0 : ve - j - 1;
+			j = ve + 1;
+
+		} else if (json[j] == '{' || json[j] == '[') {
+
+			doc->type[n] = json[j] == '{' ? object_type : array_type;
+			doc->val[n] = j;
+			doc->next[n] = top;
+			top = n + 1;
+			opened = 1;
+			token_next(t);
+			j++;
+
+		} else
+			rval = EX_JSON_PARSE_ERROR;
+
+		// Count the value in the one it is in, and close
+		// every object or array that ends after it.
+		while (!rval && top) {
+			n = top - 1;
+			close = doc->type[n] == object_type ? '}' : ']';
+			if (!opened) {
+				doc->members[n]++;
+				if (!token_is(t, json, j, close))
+					rval = token_expect(t, json, &j, ',');
+			}
+			opened = 0;
+			if (rval || !token_is(t, json, j, close))
+				break;
+			rval = token_expect(t, json, &j, close);
+			doc->vallen[n] = j - doc->val[n];
+			top = doc->next[n];
+			doc->next[n] = doc->n;
+		}
+
+		if (rval || !top)
+			break;
+
+		// On to the next member.
+		ks = ke = 0;
+		if (doc->type[top - 1] == object_type) {
+			rval = token_expect(t, json, &j, '"');
+			ks = j;
+			if (!rval)
+				rval = token_string(t, &ke);
+			j = ke + 1;
+			if (!rval)
+				rval = token_expect(t, json, &j, ':');
+		}
+
+		if (!rval && (j = skipws(json, j, t->end)) >= t->end)
+			rval = EX_JSON_PARSE_ERROR;
+		if (rval)
+			break;
 	}
 
+	*end = j;
+
+	return rval;
 }
 
-// Given a json string and a key, 
-// return the offset and length
-// of the key's value.
+// Parse a JSON context once, so that every lookup during a render
+// walks the tape instead of re-indexing the text.
 //
-// If key is not found, offset is set to 0.
+// The structure of the text is found first (see index_structure()),
+// which also counts the commas and opening brackets outside strings;
+// since every value but the first comes after one of them, that
+// sizes the tape exactly, and it is then filled in in one walk.
+// The tape is a single allocation: if arena is set, it comes from
+// there and goes away with it; otherwise free it with freedoc().
+//
+// The document does not copy the JSON; it must outlive the document.
 int
-jsonpath(const char *json, size_t jsonlen, const char *key, 
-		unsigned short *offset, unsigned short *length)
+parsedoc(const char *json, size_t jsonlen, struct arena *arena, struct jsondoc *doc)
 {
-	char		*keybuf = 0;
+	const size_t	per = 6 * sizeof(jsonoff_t) + 1;
+	struct jsonstruct s = {0};
+	struct tokens	t = {0};
+	size_t		sz = 0;
+	size_t		i = 0;
 	char		*p = 0;
-	unsigned short	*index = 0;
-	unsigned short	suboffset = 0;
-	unsigned short	sublength = 0;
 	int		rval = 0;
-	int		idx = 0;
 
-	if (!offset || !length)
-		return EX_LOGIC_ERROR;
+	memset(doc, 0, sizeof(*doc));
 
-	*offset = 0;
-	*length = 0;
+	doc->json = json;
+	doc->jsonlen = jsonlen;
+	doc->arena = arena;
 
-	// An empty key never has a value.
-	if (!key || !strlen(key))
-		return 0;
+	if (jsonlen > JSONOFF_MAX)
+		return EX_JSON_TOO_LARGE;
 
-	debug_printf("jsonpath('%s', %lu, '%s')\n", json, jsonlen, key);
+	rval = index_structure(json, jsonlen, arena, &s);
 
-	// Nor does a key in empty json.
-	if (!json || !strlen(json))
-		return rval;
+	sz = s.seps + 1;
 
-	// Only json objects have keys.
-	if ( ! is_obj(json, jsonlen) )
-		return rval;
+	if (!rval && sz > SIZE_MAX / per)
+		rval = ENOMEM;
+
+	if (!rval && (p = arena_alloc(arena, sz * per)) == NULL)
+		rval = ENOMEM;
 
-	// Look for key in current JSON object.
-	rval = index_json(json, jsonlen, &index);
 	if (!rval) {
-		idx = j0g_val(key, (char *) json, index);
+		doc->key = (jsonoff_t *) p;
+		doc->keylen = doc->key + sz;
+		doc->val = doc->keylen + sz;
+		doc->vallen = doc->val + sz;
+		doc->next = doc->vallen + sz;
+		doc->members = doc->next + sz;
+		doc->type = (uint8_t *) (doc->members + sz);
+
+		t.s = &s;
+		t.end = jsonlen;
+		t.w = (size_t) -1;
+		token_next(&t);
+
+		i = skipws(json, 0, jsonlen);
+	}
 
-		if (idx != 0) {
-			// We found the key.  
-			// Set offset, length, and trim off whitespace.
-			*offset = index[idx];
-			*length = index[idx + 1];
-			trim(json, offset, length);
-		}
+	if (!rval && i < jsonlen) {
+		rval = tape_value(doc, &t, i, &i);
+		if (!rval && t.pos < jsonlen)
+			rval = EX_JSON_PARSE_ERROR;
+	} else if (!rval) {
+		doc->n = 1;
+		doc->next[0] = 1;
+		doc->type[0] = null_type;
 	}
 
-	// We didn't find the key so try to recurse down through json.
-	//
-	// For example,
-	// if the key = "a.b"
-	// and we didn't find "a.b" as an attribute of  the top-level json object,
-	// then ...
+	if (!arena)
+		free(s.bits);
 
-	if (!rval && *offset == 0) {
-		keybuf = calloc(strlen(key), 1);
-		if (!keybuf)
-			rval = ENOMEM;
-	}
+	if (rval)
+		freedoc(doc);
 
-	if (!rval && *offset == 0) {
-		strcpy(keybuf, key);
-		p = strchr(keybuf, DOT);
-		if (p) {
-			//
-			// ... we look for a top-level attribute named "a" ...
-			//
-			*p++ = '\0';
-			idx = j0g_val(keybuf, (char *) json, index);
+	return rval;
+}
+
+void
+freedoc(struct jsondoc *doc)
+{
+	if (!doc)
+		return;
+	if (!doc->arena)
+		free(doc->key);
+	doc->key = 0;
+	doc->n = 0;
+}
+
+// Point v at the whole document, or at nothing if it
+// did not parse.
+void
+doc_root(const struct jsondoc *doc, struct jsonval *v)
+{
+	v->doc = doc->n ? doc : 0;
+	v->i = 0;
+	v->p = doc->n ? doc->json + doc->val[0] : doc->json;
+}
+
+unsigned long
+keyhash(const char *key, size_t keylen)
+{
+	unsigned long	h = 2166136261UL;
+
+	for (size_t i = 0; i < keylen; i++) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619UL;
+	}
+
+	return h;
+}
+
+// Build a hash index of an object's members: an open-addressed
+// table of at least twice as many slots as members.
+//
+// Where a key appears twice, the index keeps the one a linear
+// search of the members would find, the last.
+int
+build_member_index(struct arena *arena, const struct jsonval *obj, struct objent *e)
+{
+	const struct jsondoc *d = obj->doc;
+	jsonoff_t	*v = 0;
+	size_t		sz = 16;
+	size_t		i = 0;
+
+	while (sz < 2 * (size_t) d->members[obj->i])
+		sz *= 2;
+
+	if ((v = arena_alloc(arena, sz * sizeof(*v))) == NULL)
+		return ENOMEM;
+
+	for (size_t c = obj->i + 1; c < d->next[obj->i]; c = d->next[c]) {
+		i = keyhash(d->json + d->key[c], d->keylen[c]) & (sz - 1);
+		for (; v[i]; i = (i + 1) & (sz - 1))
+			if (d->keylen[v[i] - 1] == d->keylen[c]
+			    && !memcmp(d->json + d->key[v[i] - 1], d->json + d->key[c], d->keylen[c]))
+				break;
+		v[i] = c + 1;
+	}
+
+	e->index = v;
+	e->sz = sz;
+
+	return 0;
+}
+
+// Find (or add) an object's entry in the cache.
+// Returns NULL if the cache can't grow.
+struct objent *
+objcache_get(struct objcache *oc, size_t obj)
+{
+	struct objent	*v = 0;
+	struct objent	*e = 0;
+	size_t		sz = 0;
+	size_t		h = (obj + 1) * 2654435761UL;
+
+	if (2 * (oc->n + 1) > oc->sz) {
+		sz = oc->sz ? oc->sz * 2 : 64;
+		if ((v = arena_alloc(oc->arena, sz * sizeof(*v))) == NULL)
+			return NULL;
+		for (size_t i = 0; i < oc->sz; i++) {
+			if (!oc->v[i].obj)
+				continue;
+			e = v + ((oc->v[i].obj * 2654435761UL) & (sz - 1));
+			while (e->obj)
+				e = v + ((e - v + 1) & (sz - 1));
+			*e = oc->v[i];
+		}
+		oc->v = v;
+		oc->sz = sz;
+	}
+
+	for (e = oc->v + (h & (oc->sz - 1)); e->obj; e = oc->v + ((e - oc->v + 1) & (oc->sz - 1)))
+		if (e->obj == obj + 1)
+			return e;
+
+	e->obj = obj + 1;
+	oc->n++;
+
+	return e;
+}
+
+// Find the member named by the first keylen bytes of key
+// in an object value.  Where a key appears more than once,
+// the last one wins.
+//
+// Members are searched one by one, which only reads the keys'
+// lengths and text from the tape, except in a wide object (one with
+// at least WIDE_OBJECT members) that has been searched more than
+// WIDE_SEARCHES times through the cache oc: it gets a hash index,
+// kept in oc, and is searched in O(1) from then on.
+// oc may be NULL, and if the cache or an index can't be allocated
+// the search just stays linear.
+//
+// Returns 1 and sets \*val if it is there, 0 if it is not
+// (or if obj is not an object).
+int
+jsonval_member(struct objcache *oc, const struct jsonval *obj, const char *key, size_t keylen,
+		struct jsonval *val)
+{
+	const struct jsondoc *d = obj->doc;
+	struct objent	*e = 0;
+	size_t		found = 0;
+	size_t		i = 0;
+
+	if (!d || d->type[obj->i] != object_type)
+		return 0;
+
+	if (oc && d->members[obj->i] >= WIDE_OBJECT && (e = objcache_get(oc, obj->i)) != NULL
+	    && !e->index && ++e->searches > WIDE_SEARCHES)
+		build_member_index(oc->arena, obj, e);
+
+	if (e && e->index) {
+		i = keyhash(key, keylen) & (e->sz - 1);
+		for (; e->index[i]; i = (i + 1) & (e->sz - 1)) {
+			found = e->index[i];
+			if (d->keylen[found - 1] == keylen && !memcmp(d->json + d->key[found - 1], key, keylen))
+				break;
+			found = 0;
+		}
+	} else {
+		for (size_t c = obj->i + 1; c < d->next[obj->i]; c = d->next[c])
+			if (d->keylen[c] == keylen && !memcmp(d->json + d->key[c], key, keylen))
+				found = c + 1;
+	}
+
+	if (!found)
+		return 0;
+
+	val->doc = d;
+	val->i = found - 1;
+	val->p = d->json + d->val[found - 1];
+
+	return 1;
+}
+
+// The parsed-document version of jsonpath():
+// look for key in obj, and if it is not there and has a dot in it,
+// look for what is after the first dot in the value of what is before it.
+//
+// Members of wide objects are found through the cache oc
+// (see jsonval_member()), which may be NULL.
+//
+// Returns 1 and sets \*val if found, 0 if not.
+int
+jsonval_lookup(struct objcache *oc, const struct jsonval *obj, const char *key,
+		struct jsonval *val)
+{
+	struct jsonval	head = {0};
+	const char	*dot = 0;
+
+	if (!key || !*key)
+		return 0;
+
+	if (jsonval_member(oc, obj, key, strlen(key), val))
+		return 1;
+
+	if ((dot = strchr(key, DOT)) == NULL)
+		return 0;
+
+	if (!jsonval_member(oc, obj, key, dot - key, &head))
+		return 0;
+
+	return jsonval_lookup(oc, &head, dot + 1, val);
+}
+
+// jsonval_lookup() without a cache.
+int
+jsonval_path(const struct jsonval *obj, const char *key, struct jsonval *val)
+{
+	return jsonval_lookup(0, obj, key, val);
+}
+
+// Return 1 if the first non-whitespace character in json is a '{', 0 otherwise.
+int
+is_obj(const char *json, size_t jsonlen) 
+{
+	const char	*p;
+	for (p = json; isspace(*p) && p - json < jsonlen; p++);
+	return *p == '{';
+}
+
+
+
+
+// Move the offset and length so
+// the character sequence they define
+// does not start or end with whitespace.
+void
+trim(const char *json, size_t *offset, size_t *length)
+{
+	if (!offset || !length || !json)
+		return;
+
+	while (*length > 0 && isspace(*(json + *offset))) {
+		(*offset)++;
+		(*length)--;
+	}
+
+	while (*length > 0 && isspace(*(json + *offset + *length - 1))) {
+		(*length)--;
+	}
+
+}
+
+// Given a json string and a key, 
+// return the offset and length
+// of the key's value.
+//
+// If key is not found, offset is set to 0.
+int
+jsonpath(const char *json, size_t jsonlen, const char *key, 
+		size_t *offset, size_t *length)
+{
+	struct jsonindex index = {0};
+	const char	*p = 0;
+	size_t		suboffset = 0;
+	size_t		sublength = 0;
+	int		rval = 0;
+	size_t		idx = 0;
+
+	if (!offset || !length)
+		return EX_LOGIC_ERROR;
+
+	*offset = 0;
+	*length = 0;
+
+	// An empty key never has a value.
+	if (!key || !*key)
+		return 0;
+
+	debug_printf("jsonpath('%.*s', %lu, '%s')\n", (int) jsonlen, json, jsonlen, key);
+
+	// Nor does a key in empty json.
+	if (!json || !jsonlen)
+		return rval;
+
+	// Only json objects have keys.
+	if ( ! is_obj(json, jsonlen) )
+		return rval;
+
+	// Look for key in current JSON object.
+	rval = index_json(json, jsonlen, &index);
+	if (!rval) {
+		idx = index_find(json, &index, key, strlen(key));
+
+		if (idx != 0) {
+			// We found the key.  
+			// Set offset, length, and trim off whitespace.
+			*offset = index_at(&index, idx);
+			*length = index_at(&index, idx + 1);
+			trim(json, offset, length);
+		}
+	}
+
+	// We didn't find the key so try to recurse down through json.
+	//
+	// For example,
+	// if the key = "a.b"
+	// and we didn't find "a.b" as an attribute of  the top-level json object,
+	// then ...
+
+	if (!rval && *offset == 0) {
+		p = strchr(key, DOT);
+		if (p) {
+			//
+			// ... we look for a top-level attribute named "a" ...
+			//
+			idx = index_find(json, &index, key, p++ - key);
 			if (idx != 0) {
-				suboffset = index[idx];
-				sublength = index[idx + 1];
+				suboffset = index_at(&index, idx);
+				sublength = index_at(&index, idx + 1);
 				json += suboffset;
 				//
 				// ... and look for the key "b" in that.
@@ -370,10 +1349,9 @@ jsonpath(const char *json, size_t jsonlen, const char *key,
 	}
 
 
-	free(index);
-	free(keybuf);
+	free_index(&index);
 
-	debug_printf("		--> jsonpath returns offset, length = %u, %u\n", *offset, *length);
+	debug_printf("		--> jsonpath returns offset, length = %zu, %zu\n", *offset, *length);
 		
 	return rval;
 
@@ -382,7 +1360,7 @@ jsonpath(const char *json, size_t jsonlen, const char *key,
 int
 get_json_section(const char  *json, size_t len, 
 		char section[][MAX_KEYSZ], int base, int depth,
-		unsigned short *offset, unsigned short *length)
+		size_t *offset, size_t *length)
 		
 {
 	int		rval = 0;
@@ -411,8 +1389,8 @@ is_section_falsey(const char *json, size_t jsonlen,
 		char section[][MAX_KEYSZ], int sections_n, int *drop)
 {
 	int		rval = 0;
-	unsigned short	offset = 0;
-	unsigned short	length = 0;
+	size_t		offset = 0;
+	size_t		length = 0;
 
 	*drop = 0;
 
@@ -434,10 +1412,10 @@ peeloff_sections_from_top(const char  * const json, size_t jsonlen,
 		const char *key, char **val)
 {
 	int		rval = 0;
-	unsigned short	offset = 0;
-	unsigned short	length = 0;
-	unsigned short	section_offset = 0;
-	unsigned short	section_length = 0;
+	size_t		offset = 0;
+	size_t		length = 0;
+	size_t		section_offset = 0;
+	size_t		section_length = 0;
 
 	// Loop through all contexts, starting with first section base.
 	for (int base = 0; !rval && !*val && base < sections_n; base++) {
@@ -490,8 +1468,8 @@ peeloff_sections_from_bottom(const char *json, size_t jsonlen,
 	const char	*p = 0;
 	size_t		len = 0;
 	int		rval = 0;
-	unsigned short	offset = 0;
-	unsigned short	length = 0;
+	size_t		offset = 0;
+	size_t		length = 0;
 
 	// Loop through all contexts, starting at full section depth.
 	for (int depth = sections_n; !rval && !*val && depth > 0; depth--) {
@@ -536,10 +1514,10 @@ get(const char  *json, size_t jsonlen,
 {
 	int		rval = 0;
 	int		drop = 0;
-	unsigned short	offset = 0;
-	unsigned short	length = 0;
+	size_t		offset = 0;
+	size_t		length = 0;
 
-	debug_printf("get('%s', %lu, '%s', '%s')\n", json, jsonlen, section[sections_n], key);
+	debug_printf("get('%.*s', %lu, '%s', '%s')\n", (int) jsonlen, json, jsonlen, section[sections_n], key);
 
 	// The val pointer must be allocated.
 	if (!val)
@@ -548,7 +1526,7 @@ get(const char  *json, size_t jsonlen,
 	*val = 0;
 
 	// An empty json string is not an error.
-	if (!json || !strlen(json))
+	if (!json || !jsonlen)
 		return 0;
 
 	// If any section is falsey, key is not found.
@@ -593,473 +1571,3002 @@ get(const char  *json, size_t jsonlen,
 }
 
 
-// Look up value in JSON for the given key, and insert it into the result.
-int
-insert_value(char section[][MAX_KEYSZ], int sections_n, char *tag, char **qhtml, char *json, int raw)
+// Walk the sections down from the root of the document,
+// filling in ctx[0] (the root) through ctx[sections_n].
+// A section that is not there, and every section under it,
+// gets no value.
+void
+doc_sections(const struct jsondoc *doc, char section[][MAX_KEYSZ], int sections_n,
+		struct jsonval *ctx)
 {
-	int 		rval = 0;
-	char		*val = 0;
-	char		*escaped = 0;
-
-	debug_printf("insert_value('%s', '%s', '%s', '%s', %d)\n", section[sections_n], tag, *qhtml, json, raw);
-
-	if (!rval) {
-		/*
-		 * A tag that starts with an ampersand
-		 * is the same as a triple brace.
-		 */
-	
-		if (tag[0] == '&') {
-			raw = 1;
-			tag = tag + 1;
-		}
-	}
+	doc_root(doc, ctx);
 
-	if (!rval)
-		rval = get(json, strlen(json), section, sections_n, tag, &val);
+	for (int i = 0; i < sections_n; i++)
+		if (!ctx[i].doc || !jsonval_path(ctx + i, section[i], ctx + i + 1))
+			ctx[i + 1].doc = 0;
+}
 
+// Look a tag up in a stack of section values, where ctx[0] is the
+// document root and ctx[n] the innermost section.
+//
+// If the innermost section is falsey, key is not found.
+// Otherwise it is looked for in each section, from the inside out.
+// The tag "." is the innermost section's value itself.
+//
+// Wide objects are searched through the cache oc, which may be NULL.
+//
+// Returns 1 and sets \*v to the value (trimmed) if found, 0 if not.
+int
+resolve_ctx(struct objcache *oc, const struct jsonval *ctx, int n, const char *key,
+		struct span *v)
+{
+	struct jsonval	val = {0};
+	size_t		offset = 0;
+	size_t		length = 0;
+	int		found = 0;
 
-	if (!rval) {
-		if (raw)
-			escaped = val;
-		else
-			rval = htmlescape(val, &escaped);
-	}
+	if (ctx[n].doc && ctx[n].doc->type[ctx[n].i] == false_type)
+		return 0;
 
-	if (!rval && escaped) {
-		strcpy(*qhtml, escaped);
-		*qhtml += strlen(*qhtml);
+	if (key[0] == DOT && !key[1]) {
+		val = ctx[n];
+		found = val.doc != 0;
 	}
 
-	if (!raw)
-		free(escaped);
+	for (int depth = n; !found && depth >= 0; depth--)
+		found = ctx[depth].doc && jsonval_lookup(oc, ctx + depth, key, &val);
 
-	return rval;
-}
+	if (found) {
+		length = val.doc->vallen[val.i];
+		trim(val.p, &offset, &length);
+		v->p = val.p + offset;
+		v->len = length;
+	}
 
-		/*
-		 * Return true if the character is in the given, inclusive, range.
-		 */
-int 
-in(char c, char lo, char hi)
-{
-	return (c >= lo) && (c <= hi);
+	return found;
 }
 
-// http://en.wikipedia.org/wiki/Character_encodings_in_HTML#Illegal_characters
+// Find the value a tag refers to.
+//
+// Looks for the key in the deepest section first,
+// then peels sections off one by one, ending with the root object.
+// Each attempt walks the tape that was built once by parsedoc(),
+// so it costs time in proportion to the depth of the key,
+// not to the size of the JSON.
+//
+// Returns 1 and sets \*v to the value's trimmed text, 0 if not found.
 int
-badchar(char c)
+resolve(const struct jsondoc *doc, char section[][MAX_KEYSZ], int sections_n,
+		const char *key, struct span *v)
 {
-	return  in(c, 1, 8)
-		|| in(c, 11, 12)
-		|| in(c, 14, 31)
-		|| in(c, 127, 159)
-		;
-}
+	struct jsonval	ctx[MAX_SECTION_DEPTH + 1];
 
-int
-add_to_tag(char **qtag, char *tag, char c)
-{
-	debug_printf("add_to_tag('%s', '%s', %c)\n", *qtag, tag, c);
-	if (*qtag - tag >= MAX_KEYSZ - 1)
-		return EX_TAG_TOO_LONG;
-	if (!isspace(c))
-		*(*qtag)++ = c;
-	return 0;
-}
+	if (sections_n > MAX_SECTION_DEPTH)
+		return 0;
 
-		/*
-		 * As we drill deeper into sub and subsections,
-		 * just mash them together with a period delimiter.
-		 *
-		 * Dotted names are section short-hand in the spec,
-		 * so this should work.
-		 *
-		 * While not specified in the interpolation spec,
-		 * we do prohibit periods in the section names.
-		 */
+	doc_sections(doc, section, sections_n, ctx);
 
+	return resolve_ctx(0, ctx, sections_n, key, v);
+}
+
+// The parsed-document version of get().
 int
-push_section(char *tag,  char section[][MAX_KEYSZ], int *sections_n)
+getdoc(const struct jsondoc *doc, char section[][MAX_KEYSZ], int sections_n,
+		const char *key, char **val)
 {
-	int rval = 0;
-	if (!tag || !strlen(tag))
-		return rval;
+	struct span	v = {0};
+	int		rval = 0;
 
-	if (strlen(tag) + 1 >= MAX_KEYSZ)
-		rval = EX_TAG_TOO_LONG;
+	if (!val)
+		return EX_LOGIC_ERROR;
 
-	if (*sections_n >= MAX_SECTION_DEPTH - 1)
-		rval = EX_TOO_MANY_SECTIONS;
+	*val = 0;
 
-	if (!rval)
-		strcpy(section[(*sections_n)++], tag);
-	
-	if (!rval)
-		debug_printf("		push_section('%s') --> 'sections_n = %d'\n", tag, *sections_n);
-	else
-		debug_printf("		push_section('%s') --> 'rval = %d'\n", tag, rval);
+	if (resolve(doc, section, sections_n, key, &v)) {
+		// We found the key so make a copy of its value.
+		*val = calloc(v.len + 1, 1);
+		if (*val)
+			memcpy(*val, v.p, v.len);
+		else
+			rval = ENOMEM;
+	}
+
+	debug_printf("\"%s\" returns \"%s\" (rval = %d)\n", key, *val, rval);
 
 	return rval;
 }
 
-
+// Make sure the buffer can hold len more bytes plus a NUL.
+//
+// The buffer grows geometrically (it at least doubles),
+// so writing n bytes costs amortized O(n)
+// no matter how many small writes it takes.
 int
-pop_section(char *tag, char section[][MAX_KEYSZ], int *sections_n)
+buf_grow(struct buf *b, size_t len)
 {
-	int rval = 0;
-
-	if (!tag || !strlen(tag))
-
-		/*
-		 * Ignore empty tags.
-		 */
+	char		*p = 0;
+	size_t		sz = 0;
 
-		return rval;
+	if (b->len + len + 1 <= b->sz)
+		return 0;
 
-	if (sections_n == 0 || strcmp(tag, section[*sections_n - 1]) )
-			rval = EX_POP_DOES_NOT_MATCH;
+	sz = b->sz ? b->sz : BUFSZ_DELTA;
+	while (sz < b->len + len + 1) {
+		if (sz > SIZE_MAX / 2)
+			return ENOMEM;
+		sz *= 2;
+	}
 
-	if (!rval)
-		section[(*sections_n)--][0] = '\0';
+	if ((p = realloc(b->data, sz)) == NULL)
+		return ENOMEM;
 
-	if (!rval)
-		debug_printf("		pop_section('%s') --> sections_n = %d\n", tag, *sections_n);
-	else
-		debug_printf("		pop_section('%s') --> rval = %d\n", tag, rval);
+	b->data = p;
+	b->sz = sz;
 
-	return rval;
+	return 0;
 }
 
+// Allocate an empty buffer big enough for hint bytes.
+//
+// A good hint means the whole render fits in
+// this one allocation and the buffer never has to grow.
 int
-index_sections(const char *json, char ***section_index)
+buf_init(struct buf *b, size_t hint)
 {
-	int		rval = 0;
+	b->data = 0;
+	b->len = 0;
+	b->sz = 0;
 
-	return rval;
-}
+	if (hint < BUFSZ_DELTA)
+		hint = BUFSZ_DELTA;
 
+	if ((b->data = malloc(hint)) == NULL)
+		return ENOMEM;
 
-// Given a mustache template and some JSON, render the HTML.
+	b->sz = hint;
+	b->data[0] = '\0';
+
+	return 0;
+}
+
+// Append len bytes to the buffer and keep it NUL-terminated.
 int
-render(const char *template, char *json, char **html)
+buf_write(struct buf *b, const char *s, size_t len)
 {
-	char		section[MAX_SECTION_DEPTH][MAX_KEYSZ] = {{0}};
-	char		**section_index;
-	char		tag[MAX_KEYSZ] = {0};
-	const char	*cur= 0;
-	char		prev;
-	char		prevprev;
-	char		*qhtml = 0;
-	char		*qtag = 0;
-	int		sections_n = 0;
-	int		drop = 0;
 	int		rval = 0;
 
-	debug_printf("%s\n", "Starting to render");
+	rval = buf_grow(b, len);
 
+	if (!rval) {
+		memcpy(b->data + b->len, s, len);
+		b->len += len;
+		b->data[b->len] = '\0';
+	}
 
-	//
-	// The states and their transitions.
-	//
+	return rval;
+}
 
-	static void *gohtml[] =
-	{
-		[0 ... 122]	= &&l_html,
-		[ '{' ]		= &&l_tagp,
-		[124 ... 255]	= &&l_html
-	};
+// Write all of the iovecs to fd, picking up after short writes.
+int
+writeall(int fd, struct iovec *iov, int iov_n)
+{
+	ssize_t		n = 0;
 
-	static void *gotagp[] =
-	{
-		[0 ... 122]	= &&l_no_tag,
-		[ '{' ]		= &&l_rawtagp,
-		[124 ... 255]	= &&l_no_tag
-	};
+	while (iov_n > 0) {
+		n = writev(fd, iov, iov_n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno;
+		while (iov_n > 0 && (size_t) n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iov_n--;
+		}
+		if (iov_n > 0) {
+			iov->iov_base = (char *) iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
 
-	static void *gorawtagp[] =
-	{
-		[0 ... 34]	= &&l_no_rawtag,
-		[ '#' ]		= &&l_yes_push,	// 35
-		[36 ... 46]	= &&l_no_rawtag,
-		[ '/' ]		= &&l_yes_pop,	// 47
-		[48 ... 122]	= &&l_no_rawtag,
-		[ '{' ]		= &&l_yes_rawtag,	// 123
-		[124 ... 255]	= &&l_no_rawtag
-	};
+	return 0;
+}
 
-	static void *gopush[] =
-	{
-		[0 ... 45 ]	= &&l_push,
-		[ DOT ]		= &&l_bad_section,	// 46
-		[47 ... 124 ]	= &&l_push,
-		[ '}' ]		= &&l_xpushp,	// 125
-		[126 ... 255]	= &&l_push
-	};
+// Send everything batched in a file descriptor sink.
+int
+sink_flush(struct sink *out)
+{
+	int		rval = 0;
 
-	static void *goxpushp[] =
-	{
-		[0 ... 124 ]	= &&l_no_xpush,
-		[ '}' ]		= &&l_yes_xpush,	// 125
-		[126 ... 255]	= &&l_no_xpush
-	};
+	if (out->type != fd_sink)
+		return rval;
 
-	static void *gopop[] =
-	{
-		[0 ... 45 ]	= &&l_pop,
-		[ DOT ]		= &&l_bad_section,	// 46
-		[47 ... 124 ]	= &&l_pop,
-		[ '}' ]		= &&l_xpopp,	// 125
-		[126 ... 255]	= &&l_pop
-	};
+	rval = writeall(out->fd, out->iov, out->iov_n);
+	out->iov_n = 0;
 
-	static void *goxpopp[] =
-	{
-		[0 ... 124 ]	= &&l_no_xpop,
-		[ '}' ]			= &&l_yes_xpop,	// 125
-		[126 ... 255]	= &&l_no_xpop
-	};
+	return rval;
+}
 
-	static void *gotag[] =
-	{
-		[0 ... 124 ]	= &&l_tag,
-		[ '}' ]			= &&l_xtagp,	// 125
-		[126 ... 255]	= &&l_tag
-	};
+// Queue one span for the next writev().
+int
+sink_iov(struct sink *out, const char *s, size_t len)
+{
+	int		rval = 0;
 
-	static void *goxtagp[] =
-	{
-		[0 ... 124]	= &&l_no_xtag,
-		[ '}' ]		= &&l_yes_xtag,
-		[126 ... 255]	= &&l_no_xtag
-	};
+	if (out->iov_n == SINK_IOV_N)
+		rval = sink_flush(out);
 
-	static void *gorawtag[] =
-	{
-		[0 ... 124 ]	= &&l_rawtag,
-		[ '}' ]			= &&l_xrawpp,	// 125
-		[126 ... 255]	= &&l_rawtag
-	};
+	if (!rval) {
+		out->iov[out->iov_n].iov_base = (void *) s;
+		out->iov[out->iov_n].iov_len = len;
+		out->iov_n++;
+	}
 
-	static void *goxrawpp[] =
-	{
-		[0 ... 124]	= &&l_no_xrawp,
-		[ '}' ]		= &&l_yes_xrawp,
-		[126 ... 255]	= &&l_no_xrawp
-	};
+	return rval;
+}
 
-	static void *goxrawp[] =
-	{
-		[0 ... 124]	= &&l_no_xraw,
-		[ '}' ]		= &&l_yes_xraw,	// 125
-		[126 ... 255]	= &&l_no_xraw
-	};
+// Write bytes that stay put until the render is over:
+// literal text from the program, values in the caller's JSON,
+// or constant strings.
+//
+// A file descriptor sink queues them without copying.
+int
+sink_literal(struct sink *out, const char *s, size_t len)
+{
+	if (!len)
+		return 0;
 
-	// Allocate memory to hold HTML.
-	if (!rval) {
+	switch (out->type) {
+	case buf_sink:
+		return buf_write(out->buf, s, len);
+	case callback_sink:
+		return out->write(out->arg, s, len);
+	case fd_sink:
+		return sink_iov(out, s, len);
+	case count_sink:
+		out->len += len;
+		return 0;
+	case mem_sink:
+		if (len > out->size - out->len)
+			return EX_OUTPUT_TOO_LONG;
+		memcpy(out->mem + out->len, s, len);
+		out->len += len;
+		return 0;
+	}
+
+	return EX_LOGIC_ERROR;
+}
 
 		/*
-		 * XXX: Track size and reallocate when necessary.
+		 * Finding the next character to escape.
+		 *
+		 * Values are mostly clean text, so the scan for the next
+		 * & " < or > is what escaping costs.  On x86 it is done
+		 * 16 (SSE2) or 32 (AVX2, if the CPU has it) bytes at a time.
+		 *
+		 * '<' and '>' differ only in bit 1, and '"' and '&' only
+		 * in bit 2, so two compares find all four:
+		 * (c | 2) == '>' and (c | 4) == '&'.
 		 */
 
-		*html = (char *) calloc(BUFSZ_DELTA, 1);
+const char *
+find_special_scalar(const char *p, const char *end)
+{
+	for (; p < end; p++)
+		if ((*p | 2) == '>' || (*p | 4) == '&')
+			break;
+	return p;
+}
 
-		if  ( *html == NULL)
-			rval = ENOMEM;
+#ifdef HAVE_X86_SIMD
 
-		qhtml = *html;
+__attribute__((target("sse2")))
+const char *
+find_special_sse2(const char *p, const char *end)
+{
+	const __m128i	two = _mm_set1_epi8(2);
+	const __m128i	four = _mm_set1_epi8(4);
+	const __m128i	gt = _mm_set1_epi8('>');
+	const __m128i	amp = _mm_set1_epi8('&');
+	__m128i		v;
+	int		mask;
+
+	for (; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+		mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(_mm_or_si128(v, two), gt),
+			_mm_cmpeq_epi8(_mm_or_si128(v, four), amp)));
+		if (mask)
+			return p + __builtin_ctz(mask);
 	}
 
-	// Index the sections in the json.
-	if (!rval)
-		rval = index_sections(json, &section_index);
-
-	// Start in the HTML state.
-	void **go = gohtml;
+	return find_special_scalar(p, end);
+}
 
-	// Process template, one character at a time.
-	for(cur = template; *cur && !rval; cur++)
-	{
-		debug_printf("%c\n", *cur);
-		if (badchar(*cur))
-			rval = EX_INVALID_CHAR;
-		else
-			goto *go[(unsigned char) *cur];
-		l_loop:
-		prev = *cur;
-		prevprev = prev;
+__attribute__((target("avx2")))
+const char *
+find_special_avx2(const char *p, const char *end)
+{
+	const __m256i	two = _mm256_set1_epi8(2);
+	const __m256i	four = _mm256_set1_epi8(4);
+	const __m256i	gt = _mm256_set1_epi8('>');
+	const __m256i	amp = _mm256_set1_epi8('&');
+	__m256i		v;
+	unsigned int	mask;
+
+	for (; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((const __m256i *) p);
+		mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(_mm256_or_si256(v, two), gt),
+			_mm256_cmpeq_epi8(_mm256_or_si256(v, four), amp)));
+		if (mask)
+			return p + __builtin_ctz(mask);
 	}
 
-	return rval;
-
-	// The action on a state transition.
-	l_bad_section:
-		rval = EX_INVALID_SECTION_NAME;
-		goto l_loop;
+	// The compiler doesn't clear the upper halves before a tail call,
+	// and the SSE2 code would stall on them.
+	_mm256_zeroupper();
+	return find_special_sse2(p, end);
+}
 
-	l_html:
-		if (!drop)
-			*qhtml++ = *cur;
-		goto l_loop;
+#endif
 
-	l_tagp:
-		go = gotagp;
-		debug_printf("\t\t--> %s (%s)\n", "gotagp", "l_tagp");
-		goto l_loop;
+// Pick the widest scanner this CPU can run.
+scan_fn
+find_special_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return find_special_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return find_special_sse2;
+#endif
+	return find_special_scalar;
+}
 
-	l_no_tag:
-		*qhtml++ = prev;
-		*qhtml++ = *cur;
-		go = gohtml;
-		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_no_tag");
-		goto l_loop;
+// Write len bytes of s to the sink, HTML-escaped, finding the
+// characters to escape with find, from find_special_kernel().
+//
+// Runs of bytes that need no escaping are found with the vector
+// scanner and written straight from s in one piece,
+// and each special character is replaced by its entity,
+// so escaping needs no intermediate copy of the value.
+//
+// Only & " < and > are escaped, as the mustache spec asks;
+// ' is left alone on purpose, so a value must not be put in
+// a single-quoted attribute.
+int
+escape_to(struct sink *out, scan_fn find, const char *s, size_t len)
+{
+	const char	*end = s + len;
+	const char	*p = s;
+	const char	*q = 0;
+	const char	*entity = 0;
+	int		rval = 0;
 
-	l_rawtagp:
-		go = gorawtagp;
-		debug_printf("\t\t--> %s (%s)\n", "gorawtagp", "l_rawtagp");
-		goto l_loop;
+	while (!rval && p < end) {
+
+		q = find(p, end);
+
+		rval = sink_literal(out, p, q - p);
+		if (rval || q == end)
+			break;
+
+		switch (*q) {
+		case '&':
+			entity = "&amp;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		}
 
-	l_no_rawtag:
-		qtag = tag;
-		rval = add_to_tag(&qtag, tag, *cur);
-		go = gotag;
-		debug_printf("\t\t--> %s (%s)\n", "gotag", "l_no_rawtag");
-		goto l_loop;
+		rval = sink_literal(out, entity, strlen(entity));
+		p = q + 1;
+	}
 
-	l_yes_push:
-		qtag = tag;
-		go = gopush;
-		debug_printf("\t\t--> %s (%s)\n", "gopush", "l_yes_push");
-		goto l_loop;
+	return rval;
+}
 
-	l_yes_pop:
-		qtag = tag;
-		go = gopop;
-		debug_printf("\t\t--> %s (%s)\n", "gopop", "l_yes_pop");
-		goto l_loop;
+// Set \*lenp to the length of len bytes of s once HTML-escaped,
+// by running escape_to() with find into a sink that only counts.
+int
+escape_measure(scan_fn find, const char *s, size_t len, size_t *lenp)
+{
+	struct sink	out = {0};
+	int		rval = 0;
 
-	l_yes_rawtag:
-		qtag = tag;
-		go = gorawtag;
-		debug_printf("\t\t--> %s (%s)\n", "gorawtag", "l_yes_rawtag");
-		goto l_loop;
+	out.type = count_sink;
 
-	l_push:
-		/* FALLTHROUGH */
+	rval = escape_to(&out, find, s, len);
 
-	l_pop:
-		/* FALLTHROUGH */
+	*lenp = out.len;
 
-	l_rawtag:
-		/* FALLTHROUGH */
+	return rval;
+}
 
-	l_tag:
-		rval = add_to_tag(&qtag, tag, *cur);
-		goto l_loop;
+// Look up value in JSON for the given key, and insert it into the result.
+//
+// The first time a tag is seen under a given section path
+// its value is resolved and remembered in \*m, along with the
+// stamp of the innermost section at the time;
+// every later use of the same tag under the same sections
+// reuses that answer without walking the JSON again,
+// until a list moves on to its next element and the stamp changes.
+//
+// The value is written (or escaped, with find) straight from the
+// JSON text: no copy of it is ever made on the heap.
+int
+insert_value(struct objcache *oc, const struct jsonval *ctx, int sections_n,
+		unsigned long stamp, char *tag, struct memo *m, struct sink *out, scan_fn find, int raw)
+{
+	int 		rval = 0;
 
-	l_xpushp:
-		go = goxpushp;
-		debug_printf("\t\t--> %s (%s)\n", "goxpushp", "l_xpushp");
-		goto l_loop;
+	debug_printf("insert_value('%s', %d)\n", tag, raw);
 
-	l_no_xpush:
-		rval = add_to_tag(&qtag, tag, prev);
-		if (!rval)
-			rval = add_to_tag(&qtag, tag, *cur);
-		go = gopush;
-		debug_printf("\t\t--> %s (%s)\n", "gopush", "l_no_xpush");
-		goto l_loop;
+	if (m->stamp != stamp) {
+		m->found = resolve_ctx(oc, ctx, sections_n, tag, &m->v);
+		m->stamp = stamp;
+	}
 
-	l_yes_xpush:
-		go = gohtml;
-		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xpush");
-		rval = push_section(tag, section, &sections_n);
-		if (!rval)
-			rval = is_section_falsey(json, strlen(json), section, sections_n, &drop);
-		memset(tag, 0, MAX_KEYSZ);
-		goto l_loop;
+	if (m->found && raw)
+		rval = sink_literal(out, m->v.p, m->v.len);
+	else if (m->found)
+		rval = escape_to(out, find, m->v.p, m->v.len);
 
-	l_xpopp:
-		go = goxpopp;
-		debug_printf("\t\t--> %s (%s)\n", "goxpopp", "l_xpopp");
-		goto l_loop;
+	return rval;
+}
 
-	l_no_xpop:
-		rval = add_to_tag(&qtag, tag, prev);
-		if (!rval)
-			rval = add_to_tag(&qtag, tag, *cur);
-		go = gopop;
-		debug_printf("\t\t--> %s (%s)\n", "gopop", "l_no_xpop");
-		goto l_loop;
+		/*
+		 * Return true if the character is in the given, inclusive, range.
+		 */
+int 
+in(char c, char lo, char hi)
+{
+	return (c >= lo) && (c <= hi);
+}
 
-	l_yes_xpop:
-		go = gohtml;
+// http://en.wikipedia.org/wiki/Character_encodings_in_HTML#Illegal_characters
+int
+badchar(char c)
+{
+	return  in(c, 1, 8)
+		|| in(c, 11, 12)
+		|| in(c, 14, 31)
+		|| in(c, 127, 159)
+		;
+}
+
+int
+add_to_tag(char **qtag, char *tag, char c)
+{
+	debug_printf("add_to_tag('%s', '%s', %c)\n", *qtag, tag, c);
+	if (*qtag - tag >= MAX_KEYSZ - 1)
+		return EX_TAG_TOO_LONG;
+	if (!isspace(c))
+		*(*qtag)++ = c;
+	return 0;
+}
+
+		/*
+		 * As we drill deeper into sub and subsections,
+		 * just mash them together with a period delimiter.
+		 *
+		 * Dotted names are section short-hand in the spec,
+		 * so this should work.
+		 *
+		 * While not specified in the interpolation spec,
+		 * we do prohibit periods in the section names.
+		 */
+
+// Push a section during compilation.
+//
+// The stack holds offsets of the section names in the program's
+// text, not copies of them, so pushing and popping are O(1).
+int
+push_section(const char *tag, size_t name, size_t names[], int *sections_n)
+{
+	int rval = 0;
+
+	if (strlen(tag) + 1 >= MAX_KEYSZ)
+		rval = EX_TAG_TOO_LONG;
+
+	if (*sections_n >= MAX_SECTION_DEPTH - 1)
+		rval = EX_TOO_MANY_SECTIONS;
+
+	if (!rval)
+		names[(*sections_n)++] = name;
+	
+	if (!rval)
+		debug_printf("		push_section('%s') --> 'sections_n = %d'\n", tag, *sections_n);
+	else
+		debug_printf("		push_section('%s') --> 'rval = %d'\n", tag, rval);
+
+	return rval;
+}
+
+
+// Pop a section during compilation, checking that tag closes
+// the innermost open one.
+int
+pop_section(const char *text, const char *tag, size_t names[], int *sections_n)
+{
+	int rval = 0;
+
+	if (*sections_n == 0 || strcmp(tag, text + names[*sections_n - 1]))
+		rval = EX_POP_DOES_NOT_MATCH;
+
+	if (!rval)
+		(*sections_n)--;
+
+	if (!rval)
+		debug_printf("		pop_section('%s') --> sections_n = %d\n", tag, *sections_n);
+	else
+		debug_printf("		pop_section('%s') --> rval = %d\n", tag, rval);
+
+	return rval;
+}
+
+// Append len bytes to the program's text.
+// The offset of the first byte appended is returned in \*offset.
+//
+// The text buffer is grown by doubling, so compiling a template
+// costs amortized O(1) per byte.
+int
+addtext(struct program *prog, const char *s, size_t len, size_t *offset)
+{
+	char		*p = 0;
+	size_t		sz = 0;
+
+	if (prog->textlen + len + 1 > prog->textsz) {
+		sz = prog->textsz ? prog->textsz : BUFSZ_DELTA;
+		while (sz < prog->textlen + len + 1)
+			sz *= 2;
+		if ((p = realloc(prog->text, sz)) == NULL)
+			return ENOMEM;
+		prog->text = p;
+		prog->textsz = sz;
+	}
+
+	if (offset)
+		*offset = prog->textlen;
+
+	memcpy(prog->text + prog->textlen, s, len);
+	prog->textlen += len;
+	prog->text[prog->textlen] = '\0';
+
+	return 0;
+}
+
+// Give back what doubling left unused in a finished program's text
+// and instructions, so it holds (and, in a cache, is charged for)
+// only what it uses.  A block realloc() fails to shrink is
+// left as it is.
+void
+shrink_program(struct program *prog)
+{
+	char		*p = 0;
+	struct op	*op = 0;
+
+	if (prog->text && (p = realloc(prog->text, prog->textlen + 1)) != NULL) {
+		prog->text = p;
+		prog->textsz = prog->textlen + 1;
+	}
+
+	if (prog->ops_n && (op = realloc(prog->ops, prog->ops_n * sizeof(*op))) != NULL) {
+		prog->ops = op;
+		prog->opssz = prog->ops_n;
+	}
+}
+
+// Find the len bytes at s in the n bytes at p, or return NULL.
+const char *
+findbytes(const char *p, size_t n, const char *s, size_t len)
+{
+	const char	*end = p + n;
+
+	if (!len)
+		return p;
+
+	for (; (size_t) (end - p) >= len; p++) {
+		if ((p = memchr(p, s[0], end - p - len + 1)) == NULL)
+			return NULL;
+		if (!memcmp(p, s, len))
+			return p;
+	}
+
+	return NULL;
+}
+
+// Rebuild a finished program's text so that it starts with the
+// template it was compiled from, byte for byte and NUL-terminated.
+// Each literal is pointed at its bytes in there, looked for a little
+// past where the one before it ended; tag names, and any literal not
+// found (from a partial, say), follow.
+//
+// The cache uses the copy as the template's key, so an entry holds
+// the text once rather than twice.
+int
+rebase_text(struct program *prog, const char *template, size_t len)
+{
+	struct op	*op = 0;
+	const char	*p = 0;
+	char		*text = 0;
+	size_t		cur = 0;
+	size_t		n = len + 1;
+	size_t		w = 0;
+
+	if ((text = malloc(len + 1 + prog->textlen + 1)) == NULL)
+		return ENOMEM;
+
+	memcpy(text, template, len);
+	text[len] = '\0';
+
+	for (size_t i = 0; i < prog->ops_n; i++) {
+
+		op = prog->ops + i;
+		p = prog->text + op->offset;
+
+		if (op->code == op_literal) {
+			// Past the tag (if any) since the last literal.
+			w = len - cur;
+			if (w > op->length + 2 * MAX_KEYSZ)
+				w = op->length + 2 * MAX_KEYSZ;
+			if ((p = findbytes(template + cur, w, p, op->length)) != NULL) {
+				op->offset = p - template;
+				cur = op->offset + op->length;
+				continue;
+			}
+			p = prog->text + op->offset;
+			w = op->length;
+		} else
+			w = strlen(p) + 1;
+
+		memcpy(text + n, p, w);
+		op->offset = n;
+		n += w;
+	}
+
+	text[n] = '\0';
+
+	free(prog->text);
+	prog->text = text;
+	prog->textlen = n;
+	prog->textsz = n + 1;
+
+	if ((text = realloc(prog->text, prog->textsz)) != NULL)
+		prog->text = text;
+
+	return 0;
+}
+
+// Append an instruction to the program.
+//
+// Literal bytes that follow a literal instruction are merged into it,
+// so a run of plain HTML compiles to a single op_literal.
+// Tag names are stored NUL-terminated in the program's text.
+int
+addop(struct program *prog, enum opcode code, const char *s, size_t len)
+{
+	struct op	*op = 0;
+	size_t		offset = 0;
+	size_t		sz = 0;
+	int		rval = 0;
+
+	if (code == op_literal && prog->ops_n) {
+		op = prog->ops + prog->ops_n - 1;
+		if (op->code == op_literal && op->offset + op->length == prog->textlen) {
+			rval = addtext(prog, s, len, 0);
+			if (!rval)
+				op->length += len;
+			return rval;
+		}
+	}
+
+	if (prog->ops_n == prog->opssz) {
+		sz = prog->opssz ? prog->opssz * 2 : 64;
+		if ((op = realloc(prog->ops, sz * sizeof(*op))) == NULL)
+			return ENOMEM;
+		prog->ops = op;
+		prog->opssz = sz;
+	}
+
+	rval = addtext(prog, s, len, &offset);
+
+	if (!rval && code != op_literal)
+
+		/*
+		 * Skip past the tag name's NUL terminator, so the
+		 * next literal starts a new span.
+		 */
+
+		prog->textlen++;
+
+	if (!rval) {
+		op = prog->ops + prog->ops_n++;
+		op->code = code;
+		op->offset = offset;
+		op->length = len;
+		op->slot = 0;
+		op->jump = 0;
+	}
+
+	return rval;
+}
+
+// FNV-1a, mixed with the parent id.
+unsigned long
+internhash(int parent, const char *name)
+{
+	unsigned long	h = 2166136261UL ^ (unsigned long) parent;
+
+	for (; *name; name++) {
+		h ^= (unsigned char) *name;
+		h *= 16777619UL;
+	}
+
+	return h;
+}
+
+// Return (in \*id) the small integer naming (parent, name),
+// handing out the next one if this pair has not been seen before.
+//
+// name is an offset into the program's text, which may move
+// while the template is being compiled.
+int
+intern(struct interntab *t, const char *text, int parent, size_t name, int *id)
+{
+	struct internent *v = 0;
+	struct internent *e = 0;
+	unsigned long	h = internhash(parent, text + name);
+	size_t		sz = 0;
+
+	if (2 * (t->n + 1) > t->sz) {
+		sz = t->sz ? t->sz * 2 : 64;
+		if ((v = calloc(sz, sizeof(*v))) == NULL)
+			return ENOMEM;
+		for (size_t i = 0; i < t->sz; i++) {
+			if (!t->v[i].used)
+				continue;
+			e = v + (t->v[i].hash & (sz - 1));
+			while (e->used)
+				e = v + ((e - v + 1) & (sz - 1));
+			*e = t->v[i];
+		}
+		free(t->v);
+		t->v = v;
+		t->sz = sz;
+	}
+
+	for (e = t->v + (h & (t->sz - 1)); e->used; e = t->v + ((e - t->v + 1) & (t->sz - 1))) {
+		if (e->hash == h && e->parent == parent && !strcmp(text + e->name, text + name)) {
+			*id = e->id;
+			return 0;
+		}
+	}
+
+	e->used = 1;
+	e->hash = h;
+	e->parent = parent;
+	e->name = name;
+	e->id = *id = (int) t->n++;
+
+	return 0;
+}
+
+// Record a completed tag in the program.
+//
+// A tag that starts with an ampersand is the same as a triple brace.
+// Section tags are checked for balance here, once,
+// instead of on every render.
+//
+// Each section path is interned as it is pushed (path[] holds the
+// ids of the paths on the stack), and each value tag is given the
+// memo slot for its (section path, name) pair.  A tag that is repeated
+// under the same sections shares its slot, so at render time
+// it is only resolved once.
+//
+// A section or inverted section is given a slot too, for looking its
+// name up in its parent, so {{#x}}..{{/x}}{{^x}}..{{/x}} resolves x
+// once.  Those are keyed on -2 - path, apart from the value tags
+// (and from the -1 of a partial's body).  An inverted section's body
+// sees its parent's value, not x's, so its own path is kept apart
+// the same way.
+int
+addtag(struct program *prog, enum opcode code, char *tag,
+		size_t names[], int *sections_n, int path[],
+		struct interntab *paths, struct interntab *slots)
+{
+	struct op	*op = 0;
+	int		id = 0;
+	int		rval = 0;
+
+	if ((code == op_push || code == op_invert || code == op_pop) && !strlen(tag))
+
+		/*
+		 * Ignore empty section tags.
+		 */
+
+		return rval;
+
+	if ((code == op_escaped || code == op_raw) && tag[0] == '&') {
+		code = op_raw;
+		tag++;
+	}
+
+	if (code == op_pop)
+		rval = pop_section(prog->text, tag, names, sections_n);
+
+	if (!rval)
+		rval = addop(prog, code, tag, strlen(tag));
+
+	if (!rval)
+		op = prog->ops + prog->ops_n - 1;
+
+	if (!rval && (code == op_push || code == op_invert)) {
+		rval = intern(slots, prog->text, -2 - path[*sections_n], op->offset, &op->slot);
+		prog->slots_n = slots->n;
+	}
+
+	if (!rval && (code == op_push || code == op_invert))
+		rval = push_section(tag, op->offset, names, sections_n);
+
+	if (!rval && code == op_push) {
+		rval = intern(paths, prog->text, path[*sections_n - 1], op->offset, &id);
+		path[*sections_n] = id + 1;
+	}
+	else if (!rval && code == op_invert) {
+		rval = intern(paths, prog->text, -2 - path[*sections_n - 1], op->offset, &id);
+		path[*sections_n] = id + 1;
+	}
+	else if (!rval && code != op_pop) {
+		rval = intern(slots, prog->text, path[*sections_n], op->offset, &op->slot);
+		prog->slots_n = slots->n;
+	}
+
+	return rval;
+}
+
+int	compile_text(struct compiler *c, const char *template, size_t len);
+
+// Compile a partial tag: inline the partial it names, or call it
+// if it is already being inlined (it includes itself) or partials
+// are nested MAX_PARTIAL_DEPTH deep.
+int
+addpartial(struct compiler *c, const char *name)
+{
+	const char	*text = 0;
+	size_t		len = 0;
+	int		base = 0;
+	int		i = 0;
+	int		rval = 0;
+
+	if (!*name || !c->load)
+		return rval;
+
+	for (i = 0; i < c->inlining_n; i++)
+		if (!strcmp(c->inlining[i], name))
+			break;
+
+	if (i < c->inlining_n || c->inlining_n == MAX_PARTIAL_DEPTH) {
+		c->calls++;
+		return addop(c->prog, op_call, name, strlen(name));
+	}
+
+	if (c->load(c->arg, name, &text, &len))
+		return rval;
+
+	base = c->base;
+	c->base = c->sections_n;
+	c->inlining[c->inlining_n++] = name;
+
+	rval = compile_text(c, text, len);
+	if (!rval && c->sections_n != c->base)
+		rval = EX_POP_DOES_NOT_MATCH;
+
+	c->inlining_n--;
+	c->base = base;
+
+	return rval;
+}
+
+void
+free_program(struct program *prog)
+{
+	if (!prog)
+		return;
+	free(prog->text);
+	free(prog->ops);
+	free(prog);
+}
+
+		/*
+		 * Skipping over literal HTML.
+		 *
+		 * Most of a template is plain text that the state machine
+		 * would copy one byte per dispatch.  In the HTML state
+		 * the only bytes that matter are '{' and the invalid
+		 * control characters that badchar() rejects, so the
+		 * compiler jumps straight to the next one of those and
+		 * takes everything before it as one literal.
+		 *
+		 * A byte is bad if it is below 32 and not a NUL, tab,
+		 * newline or carriage return.  badchar()'s 127 to 159
+		 * range never matches where char is signed, as it is
+		 * on x86, so the vector kernels leave it alone too.
+		 */
+
+const char *
+find_html_stop_scalar(const char *p, const char *end)
+{
+	for (; p < end; p++)
+		if (*p == '{' || badchar(*p))
+			break;
+	return p;
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+const char *
+find_html_stop_sse2(const char *p, const char *end)
+{
+	const __m128i	brace = _mm_set1_epi8('{');
+	const __m128i	ctl = _mm_set1_epi8(31);
+	const __m128i	tab = _mm_set1_epi8('\t');
+	const __m128i	nl = _mm_set1_epi8('\n');
+	const __m128i	cr = _mm_set1_epi8('\r');
+	const __m128i	nul = _mm_setzero_si128();
+	__m128i		v, low, ws;
+	int		mask;
+
+	for (; end - p >= 16; p += 16) {
+		v = _mm_loadu_si128((const __m128i *) p);
+		low = _mm_cmpeq_epi8(_mm_max_epu8(v, ctl), ctl);
+		ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nul)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+		mask = _mm_movemask_epi8(_mm_or_si128(_mm_andnot_si128(ws, low),
+			_mm_cmpeq_epi8(v, brace)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	return find_html_stop_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+const char *
+find_html_stop_avx2(const char *p, const char *end)
+{
+	const __m256i	brace = _mm256_set1_epi8('{');
+	const __m256i	ctl = _mm256_set1_epi8(31);
+	const __m256i	tab = _mm256_set1_epi8('\t');
+	const __m256i	nl = _mm256_set1_epi8('\n');
+	const __m256i	cr = _mm256_set1_epi8('\r');
+	const __m256i	nul = _mm256_setzero_si256();
+	__m256i		v, low, ws;
+	unsigned int	mask;
+
+	for (; end - p >= 32; p += 32) {
+		v = _mm256_loadu_si256((const __m256i *) p);
+		low = _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctl), ctl);
+		ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, tab), _mm256_cmpeq_epi8(v, nul)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr)));
+		mask = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_andnot_si256(ws, low), _mm256_cmpeq_epi8(v, brace)));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+
+	// As in find_special_avx2(), clear the upper halves first.
+	_mm256_zeroupper();
+	return find_html_stop_sse2(p, end);
+}
+
+#endif
+
+scan_fn
+find_html_stop_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return find_html_stop_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return find_html_stop_sse2;
+#endif
+	return find_html_stop_scalar;
+}
+
+// Compile a mustache template into a program.
+//
+// The template is lexed once, here, by the state machine
+// shown in doc/state.dot; runs of plain HTML are skipped
+// with find_html_stop() rather than a byte at a time.
+// The resulting program is a flat list of literal spans and
+// tags that render_compiled() executes without looking at the
+// template again.
+// It is not modified by rendering, so it can be reused
+// for as many renders as the caller likes.
+// Partial tags are left out; see compile_template_partials().
+//
+// Free the program with free_program().
+int
+compile_template(const char *template, struct program **progp)
+{
+	return compile_template_len(template, template ? strlen(template) : 0, progp);
+}
+
+// compile_template() for the len bytes at template,
+// which need not be NUL-terminated.
+int
+compile_template_len(const char *template, size_t len, struct program **progp)
+{
+	return compile_template_partials(template, len, 0, 0, progp);
+}
+
+// Give each call of a recursive partial the op its body starts at,
+// adding the body to the end of the program the first time one
+// is called.  The body is compiled as though it were a template of
+// its own, except that it can call itself.  Bodies may call other
+// partials that need bodies in turn; those are added after it.
+int
+link_partials(struct compiler *c)
+{
+	struct program	*prog = c->prog;
+	struct op	*op = 0;
+	char		name[MAX_KEYSZ] = {0};
+	const char	*text = 0;
+	size_t		len = 0;
+	int		id = 0;
+	int		rval = 0;
+
+	for (size_t i = 0; !rval && i < prog->ops_n; i++) {
+
+		if (prog->ops[i].code != op_call || prog->ops[i].jump)
+			continue;
+
+		for (size_t k = 0; k < i; k++) {
+			op = prog->ops + k;
+			if (op->code == op_call && op->jump
+			    && !strcmp(prog->text + op->offset, prog->text + prog->ops[i].offset)) {
+				prog->ops[i].jump = op->jump;
+				break;
+			}
+		}
+
+		if (prog->ops[i].jump)
+			continue;
+
+		prog->ops[i].jump = prog->ops_n;
+
+		// The program's text moves as the body is added to it.
+		strcpy(name, prog->text + prog->ops[i].offset);
+
+		if (c->load(c->arg, name, &text, &len))
+			text = 0;
+
+		// The body's tags get memo slots of their own.
+		rval = intern(&c->paths, prog->text, -1, prog->ops[i].offset, &id);
+
+		c->sections_n = 0;
+		c->base = 0;
+		c->path[0] = id + 1;
+		c->inlining[0] = name;
+		c->inlining_n = 1;
+
+		if (!rval && text)
+			rval = compile_text(c, text, len);
+		if (!rval && c->sections_n)
+			rval = EX_POP_DOES_NOT_MATCH;
+		if (!rval)
+			rval = addop(prog, op_return, "", 0);
+	}
+
+	return rval;
+}
+
+// Give each section's push (or invert) the index of the pop that
+// closes it, so a section that is skipped costs one jump however
+// long its body.  A section left open runs to the end of the
+// template, or to the op_return that ends it.
+int
+link_sections(struct program *prog)
+{
+	size_t		open[MAX_SECTION_DEPTH] = {0};
+	struct op	*op = 0;
+	int		n = 0;
+
+	for (size_t i = 0; i < prog->ops_n; i++) {
+		op = prog->ops + i;
+		if (op->code == op_return)
+			while (n)
+				prog->ops[open[--n]].jump = i;
+		if (!prog->text[op->offset])
+			continue;
+		if (op->code == op_push || op->code == op_invert) {
+			if (n == MAX_SECTION_DEPTH)
+				return EX_TOO_MANY_SECTIONS;
+			open[n++] = i;
+		}
+		else if (op->code == op_pop && n)
+			prog->ops[open[--n]].jump = i;
+	}
+
+	while (n)
+		prog->ops[open[--n]].jump = prog->ops_n;
+
+	return 0;
+}
+
+// compile_template_len(), with partial tags ({{> name}}) filled in
+// from load.  A partial is inlined, compiled into the program
+// where it is used, so it costs nothing at render time; one that
+// includes itself, directly or through others, is compiled once
+// at the end of the program and called instead (see link_partials()).
+// Partials that load can't find are left out.
+//
+// The text load gives back must stay valid until this returns.
+int
+compile_template_partials(const char *template, size_t len, partial_fn load, void *arg,
+		struct program **progp)
+{
+	struct compiler	*c = 0;
+	int		rval = 0;
+
+	debug_printf("%s\n", "Starting to compile");
+
+	if (!progp)
+		return EX_LOGIC_ERROR;
+
+	*progp = 0;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return ENOMEM;
+
+	c->load = load;
+	c->arg = arg;
+
+	if ((c->prog = calloc(1, sizeof(*c->prog))) == NULL)
+		rval = ENOMEM;
+
+	if (!rval && template)
+		rval = compile_text(c, template, len);
+
+	// The template proper ends here, if partials follow it.
+	if (!rval && c->calls)
+		rval = addop(c->prog, op_return, "", 0);
+
+	if (!rval && c->calls)
+		rval = link_partials(c);
+
+	if (!rval)
+		rval = link_sections(c->prog);
+
+	if (!rval)
+		shrink_program(c->prog);
+
+	free(c->paths.v);
+	free(c->slots.v);
+
+	if (!rval)
+		*progp = c->prog;
+	else
+		free_program(c->prog);
+
+	free(c);
+
+	return rval;
+}
+
+// Run the state machine over a template (or a partial) and add what
+// it finds to the program being compiled, under the sections c has
+// open.  A partial must close the sections it opens.
+int
+compile_text(struct compiler *c, const char *template, size_t len)
+{
+	char		tag[MAX_KEYSZ] = {0};
+	char		brace[2] = {0};
+	struct program	*prog = c->prog;
+	scan_fn		find_html_stop = find_html_stop_kernel();
+	const char	*cur= 0;
+	const char	*end = 0;
+	const char	*p = 0;
+	char		prev = 0;
+	char		prevprev = 0;
+	char		*qtag = 0;
+	int		rval = 0;
+
+	//
+	// The states and their transitions.
+	//
+
+	static void *const gohtml[] =
+	{
+		[0 ... 122]	= &&l_html,
+		[ '{' ]		= &&l_tagp,
+		[124 ... 255]	= &&l_html
+	};
+
+	static void *const gotagp[] =
+	{
+		[0 ... 122]	= &&l_no_tag,
+		[ '{' ]		= &&l_rawtagp,
+		[124 ... 255]	= &&l_no_tag
+	};
+
+	static void *const gorawtagp[] =
+	{
+		[0 ... 34]	= &&l_no_rawtag,
+		[ '#' ]		= &&l_yes_push,	// 35
+		[36 ... 46]	= &&l_no_rawtag,
+		[ '/' ]		= &&l_yes_pop,	// 47
+		[48 ... 61]	= &&l_no_rawtag,
+		[ '>' ]		= &&l_yes_partial,	// 62
+		[63 ... 93]	= &&l_no_rawtag,
+		[ '^' ]		= &&l_yes_invert,	// 94
+		[95 ... 122]	= &&l_no_rawtag,
+		[ '{' ]		= &&l_yes_rawtag,	// 123
+		[124 ... 255]	= &&l_no_rawtag
+	};
+
+	static void *const gopush[] =
+	{
+		[0 ... 45 ]	= &&l_push,
+		[ DOT ]		= &&l_bad_section,	// 46
+		[47 ... 124 ]	= &&l_push,
+		[ '}' ]		= &&l_xpushp,	// 125
+		[126 ... 255]	= &&l_push
+	};
+
+	static void *const goxpushp[] =
+	{
+		[0 ... 124 ]	= &&l_no_xpush,
+		[ '}' ]		= &&l_yes_xpush,	// 125
+		[126 ... 255]	= &&l_no_xpush
+	};
+
+	static void *const goinvert[] =
+	{
+		[0 ... 45 ]	= &&l_invert,
+		[ DOT ]		= &&l_bad_section,	// 46
+		[47 ... 124 ]	= &&l_invert,
+		[ '}' ]		= &&l_xinvertp,	// 125
+		[126 ... 255]	= &&l_invert
+	};
+
+	static void *const goxinvertp[] =
+	{
+		[0 ... 124 ]	= &&l_no_xinvert,
+		[ '}' ]		= &&l_yes_xinvert,	// 125
+		[126 ... 255]	= &&l_no_xinvert
+	};
+
+	static void *const gopop[] =
+	{
+		[0 ... 45 ]	= &&l_pop,
+		[ DOT ]		= &&l_bad_section,	// 46
+		[47 ... 124 ]	= &&l_pop,
+		[ '}' ]		= &&l_xpopp,	// 125
+		[126 ... 255]	= &&l_pop
+	};
+
+	static void *const goxpopp[] =
+	{
+		[0 ... 124 ]	= &&l_no_xpop,
+		[ '}' ]			= &&l_yes_xpop,	// 125
+		[126 ... 255]	= &&l_no_xpop
+	};
+
+	static void *const gopartial[] =
+	{
+		[0 ... 124 ]	= &&l_partial,
+		[ '}' ]		= &&l_xpartialp,	// 125
+		[126 ... 255]	= &&l_partial
+	};
+
+	static void *const goxpartialp[] =
+	{
+		[0 ... 124 ]	= &&l_no_xpartial,
+		[ '}' ]		= &&l_yes_xpartial,	// 125
+		[126 ... 255]	= &&l_no_xpartial
+	};
+
+	static void *const gotag[] =
+	{
+		[0 ... 124 ]	= &&l_tag,
+		[ '}' ]			= &&l_xtagp,	// 125
+		[126 ... 255]	= &&l_tag
+	};
+
+	static void *const goxtagp[] =
+	{
+		[0 ... 124]	= &&l_no_xtag,
+		[ '}' ]		= &&l_yes_xtag,
+		[126 ... 255]	= &&l_no_xtag
+	};
+
+	static void *const gorawtag[] =
+	{
+		[0 ... 124 ]	= &&l_rawtag,
+		[ '}' ]			= &&l_xrawpp,	// 125
+		[126 ... 255]	= &&l_rawtag
+	};
+
+	static void *const goxrawpp[] =
+	{
+		[0 ... 124]	= &&l_no_xrawp,
+		[ '}' ]		= &&l_yes_xrawp,
+		[126 ... 255]	= &&l_no_xrawp
+	};
+
+	static void *const goxrawp[] =
+	{
+		[0 ... 124]	= &&l_no_xraw,
+		[ '}' ]		= &&l_yes_xraw,	// 125
+		[126 ... 255]	= &&l_no_xraw
+	};
+
+	// Start in the HTML state.
+	void *const *go = gohtml;
+
+	end = template + len;
+
+	// Process template, one character at a time.
+	for(cur = template; cur < end && !rval; cur++)
+	{
+		debug_printf("%c\n", *cur);
+		if (badchar(*cur))
+			rval = EX_INVALID_CHAR;
+		else
+			goto *go[(unsigned char) *cur];
+		l_loop:
+		prevprev = prev;
+		prev = *cur;
+	}
+
+	return rval;
+
+	// The action on a state transition.
+	l_bad_section:
+		rval = EX_INVALID_SECTION_NAME;
+		goto l_loop;
+
+	l_html:
+		p = find_html_stop(cur + 1, end);
+		rval = addop(prog, op_literal, cur, p - cur);
+		cur = p - 1;
+		goto l_loop;
+
+	l_tagp:
+		go = gotagp;
+		debug_printf("\t\t--> %s (%s)\n", "gotagp", "l_tagp");
+		goto l_loop;
+
+	l_no_tag:
+		brace[0] = prev;
+		rval = addop(prog, op_literal, brace, 1);
+		if (!rval)
+			rval = addop(prog, op_literal, cur, 1);
+		go = gohtml;
+		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_no_tag");
+		goto l_loop;
+
+	l_rawtagp:
+		go = gorawtagp;
+		debug_printf("\t\t--> %s (%s)\n", "gorawtagp", "l_rawtagp");
+		goto l_loop;
+
+	l_no_rawtag:
+		qtag = tag;
+		rval = add_to_tag(&qtag, tag, *cur);
+		go = gotag;
+		debug_printf("\t\t--> %s (%s)\n", "gotag", "l_no_rawtag");
+		goto l_loop;
+
+	l_yes_push:
+		qtag = tag;
+		go = gopush;
+		debug_printf("\t\t--> %s (%s)\n", "gopush", "l_yes_push");
+		goto l_loop;
+
+	l_yes_invert:
+		qtag = tag;
+		go = goinvert;
+		debug_printf("\t\t--> %s (%s)\n", "goinvert", "l_yes_invert");
+		goto l_loop;
+
+	l_yes_pop:
+		qtag = tag;
+		go = gopop;
+		debug_printf("\t\t--> %s (%s)\n", "gopop", "l_yes_pop");
+		goto l_loop;
+
+	l_yes_partial:
+		qtag = tag;
+		go = gopartial;
+		debug_printf("\t\t--> %s (%s)\n", "gopartial", "l_yes_partial");
+		goto l_loop;
+
+	l_yes_rawtag:
+		qtag = tag;
+		go = gorawtag;
+		debug_printf("\t\t--> %s (%s)\n", "gorawtag", "l_yes_rawtag");
+		goto l_loop;
+
+	l_push:
+		/* FALLTHROUGH */
+
+	l_invert:
+		/* FALLTHROUGH */
+
+	l_partial:
+		/* FALLTHROUGH */
+
+	l_pop:
+		/* FALLTHROUGH */
+
+	l_rawtag:
+		/* FALLTHROUGH */
+
+	l_tag:
+		rval = add_to_tag(&qtag, tag, *cur);
+		goto l_loop;
+
+	l_xpushp:
+		go = goxpushp;
+		debug_printf("\t\t--> %s (%s)\n", "goxpushp", "l_xpushp");
+		goto l_loop;
+
+	l_no_xpush:
+		rval = add_to_tag(&qtag, tag, prev);
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = gopush;
+		debug_printf("\t\t--> %s (%s)\n", "gopush", "l_no_xpush");
+		goto l_loop;
+
+	l_yes_xpush:
+		go = gohtml;
+		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xpush");
+		rval = addtag(prog, op_push, tag, c->names, &c->sections_n, c->path, &c->paths, &c->slots);
+		memset(tag, 0, MAX_KEYSZ);
+		goto l_loop;
+
+	l_xinvertp:
+		go = goxinvertp;
+		debug_printf("\t\t--> %s (%s)\n", "goxinvertp", "l_xinvertp");
+		goto l_loop;
+
+	l_no_xinvert:
+		rval = add_to_tag(&qtag, tag, prev);
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = goinvert;
+		debug_printf("\t\t--> %s (%s)\n", "goinvert", "l_no_xinvert");
+		goto l_loop;
+
+	l_yes_xinvert:
+		go = gohtml;
+		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xinvert");
+		rval = addtag(prog, op_invert, tag, c->names, &c->sections_n, c->path, &c->paths, &c->slots);
+		memset(tag, 0, MAX_KEYSZ);
+		goto l_loop;
+
+	l_xpopp:
+		go = goxpopp;
+		debug_printf("\t\t--> %s (%s)\n", "goxpopp", "l_xpopp");
+		goto l_loop;
+
+	l_no_xpop:
+		rval = add_to_tag(&qtag, tag, prev);
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = gopop;
+		debug_printf("\t\t--> %s (%s)\n", "gopop", "l_no_xpop");
+		goto l_loop;
+
+	l_yes_xpop:
+		go = gohtml;
 		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xpop");
-		rval = pop_section(tag, section, &sections_n);
+		if (*tag && c->sections_n <= c->base)
+			rval = EX_POP_DOES_NOT_MATCH;
+		else
+			rval = addtag(prog, op_pop, tag, c->names, &c->sections_n, c->path, &c->paths, &c->slots);
+		memset(tag, 0, MAX_KEYSZ);
+		goto l_loop;
+
+	l_xpartialp:
+		go = goxpartialp;
+		debug_printf("\t\t--> %s (%s)\n", "goxpartialp", "l_xpartialp");
+		goto l_loop;
+
+	l_no_xpartial:
+		rval = add_to_tag(&qtag, tag, prev);
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = gopartial;
+		debug_printf("\t\t--> %s (%s)\n", "gopartial", "l_no_xpartial");
+		goto l_loop;
+
+	l_yes_xpartial:
+		go = gohtml;
+		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xpartial");
+		rval = addpartial(c, tag);
+		memset(tag, 0, MAX_KEYSZ);
+		goto l_loop;
+
+	l_xtagp:
+		go = goxtagp;
+		debug_printf("\t\t--> %s (%s)\n", "goxtagp", "l_xtagp");
+		goto l_loop;
+
+	l_no_xtag:
+		rval = add_to_tag(&qtag, tag, prev);
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = gotag;
+		debug_printf("\t\t--> %s (%s)\n", "gotag", "l_no_xtag");
+		goto l_loop;
+
+	l_yes_xtag:
+		go = gohtml;
+		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xtag");
+		rval = addtag(prog, op_escaped, tag, c->names, &c->sections_n, c->path, &c->paths, &c->slots);
+		memset(tag, 0, MAX_KEYSZ);
+		goto l_loop;
+
+	l_xrawpp:
+		go = goxrawpp;
+		debug_printf("\t\t--> %s (%s)\n", "goxrawpp", "l_xrawpp");
+		goto l_loop;
+
+	l_no_xrawp:
+		rval = add_to_tag(&qtag, tag, prev);
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = gorawtag;
+		debug_printf("\t\t--> %s (%s)\n", "gorawtag", "l_no_xrawp");
+		goto l_loop;
+
+	l_yes_xrawp:
+		go = goxrawp;
+		debug_printf("\t\t--> %s (%s)\n", "goxrawp", "l_yes_xrawp");
+		goto l_loop;
+
+	l_no_xraw:
+		rval = add_to_tag(&qtag, tag, prevprev);;
+		if (!rval)
+			rval = add_to_tag(&qtag, tag, prev);
 		if (!rval)
-			rval = is_section_falsey(json, strlen(json), section, sections_n, &drop);
+			rval = add_to_tag(&qtag, tag, *cur);
+		go = gorawtag;
+		debug_printf("\t\t--> %s (%s)\n", "gorawtag", "l_no_xraw");
+		goto l_loop;
+
+	l_yes_xraw:
+		go = gohtml;
+		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xraw");
+		rval = addtag(prog, op_raw, tag, c->names, &c->sections_n, c->path, &c->paths, &c->slots);
 		memset(tag, 0, MAX_KEYSZ);
 		goto l_loop;
 
-	l_xtagp:
-		go = goxtagp;
-		debug_printf("\t\t--> %s (%s)\n", "goxtagp", "l_xtagp");
-		goto l_loop;
+}
+
+// Point a list section's context at its current element,
+// and give it a new stamp so memoized values under it are redone.
+void
+enter_element(struct frame *f, struct jsonval *ctx, unsigned long *clock)
+{
+	ctx->i = f->elem;
+	ctx->p = ctx->doc->json + ctx->doc->val[f->elem];
+	f->stamp = ++*clock;
+}
+
+// Look the name of the section just pushed, ctx[n], up in the
+// sections around it, from the inside out as resolve_ctx() does,
+// setting ctx[n] (whose doc is NULL if it isn't anywhere).
+//
+// The answer is kept in the section's memo slot for as long as the
+// parent's stamp holds, so a section and an inverted section on the
+// same name under the same parent only look it up once.
+void
+find_section(struct objcache *oc, struct jsonval *ctx, int n,
+		unsigned long stamp, const char *name, struct memo *m)
+{
+	struct jsonval	*v = ctx + n;
+	int		found = 0;
+
+	if (m->stamp == stamp) {
+		*v = ctx[0];
+		v->doc = m->found ? ctx[0].doc : 0;
+		v->p = m->v.p;
+		v->i = m->node;
+		return;
+	}
+
+	for (int depth = n - 1; !found && depth >= 0; depth--)
+		found = ctx[depth].doc && jsonval_lookup(oc, ctx + depth, name, v);
+
+	if (!found)
+		v->doc = 0;
+
+	m->stamp = stamp;
+	m->found = found;
+	m->v.p = v->p;
+	m->node = v->i;
+}
+
+// Whether a section's value means its body is skipped (and an
+// inverted section's is run): missing, false, null or an empty list.
+int
+section_falsey(const struct jsonval *v)
+{
+	if (!v->doc)
+		return 1;
+
+	switch (v->doc->type[v->i]) {
+	case false_type:
+	case null_type:
+		return 1;
+	case array_type:
+		return v->doc->members[v->i] == 0;
+	default:
+		return 0;
+	}
+}
+
+// Set up the section just pushed, at ctx[n] and f[0], by looking
+// its name up in the sections around it (see find_section()).
+//
+// A list's body is then run once for each element, starting with
+// the first, which is the entry after the list's own in the tape;
+// each one after that is the last one's next sibling.
+//
+// Sets \*falsey as section_falsey() does.
+int
+enter_section(struct objcache *oc, struct jsonval *ctx, int n, struct frame *f,
+		const char *name, struct memo *m, unsigned long *clock, int *falsey)
+{
+	f->n = 0;
+	f->i = 0;
+	f->stamp = f[-1].stamp;
+
+	find_section(oc, ctx, n, f->stamp, name, m);
+	ctx += n;
+
+	if ((*falsey = section_falsey(ctx)) != 0)
+		return 0;
+
+	if (ctx->doc->type[ctx->i] != array_type)
+		return 0;
+
+	f->n = ctx->doc->members[ctx->i];
+
+	f->elem = ctx->i + 1;
+	enter_element(f, ctx, clock);
+
+	return 0;
+}
+
+int	run_ops(struct exec *x, size_t from, size_t to);
+
+// Render elements lo to hi of the list at the innermost section
+// of a copy of the parent's state, into the chunk's own buffer.
+// The first chunk's output is the next in order, so it is written
+// straight to the parent's sink instead.  If the parent only counts,
+// so does each chunk, leaving its count in c->b.len.
+//
+// The copy shares the parsed JSON and the program with the parent,
+// both of which are only read.
+// Everything it writes (memo, arena, the frames of lists nested
+// inside this one, and the output) is its own.
+void *
+render_chunk(void *arg)
+{
+	struct chunk	*c = arg;
+	struct exec	*x = 0;
+	struct sink	out = {0};
+	struct frame	*f = 0;
+	int		d = c->parent->sections_n;
+	int		rval = 0;
+
+	if ((x = malloc(sizeof(*x))) == NULL) {
+		c->rval = ENOMEM;
+		return 0;
+	}
+
+	*x = *c->parent;
+	memset(&x->arena, 0, sizeof(x->arena));
+	memset(&x->objs, 0, sizeof(x->objs));
+	x->objs.arena = &x->arena;
+	SLIST_INIT(&x->held);
+	memset(x->frame + d + 1, 0, (MAX_SECTION_DEPTH - d) * sizeof(*f));
+	x->threads = 1;
+	x->out = &out;
+
+	out.type = buf_sink;
+	out.buf = &c->b;
+
+	if (c->lo == 0)
+		x->out = c->parent->out;
+	else if (c->parent->out->type == count_sink)
+		out.type = count_sink;
+	else
+		rval = buf_init(&c->b, 0);
+
+	if (!rval && (x->memo = arena_alloc(&x->arena, (x->prog->slots_n + 1) * sizeof(*x->memo))) == NULL)
+		rval = ENOMEM;
+
+	f = x->frame + d;
+	f->elem = c->first;
+	for (f->i = c->lo; !rval && f->i < c->hi; f->i++) {
+		enter_element(f, x->ctx + d, &x->clock);
+		rval = run_ops(x, f->start, c->close);
+		f->elem = x->ctx[d].doc->next[f->elem];
+	}
+
+	if (out.type == count_sink)
+		c->b.len = out.len;
+
+	arena_free(&x->arena);
+	free(x);
+
+	c->rval = rval;
+
+	return 0;
+}
+
+// Render the list section opened at ops[push], which has just been
+// entered, by splitting its elements into chunks of at least
+// PAR_MIN_ELEMENTS and rendering each on its own thread.
+// The first chunk writes to the sink as it goes; the rest are
+// handed to it in order once all are done.
+//
+// An fd sink takes those buffers as they are, without copying, and
+// they are kept on x->held until the render ends, since it may still
+// point into them.  A buffer (or memory) sink has to copy them, since
+// the output is one block and no chunk's length is known until it is
+// rendered; a buffer is grown once for all of them first, and each
+// chunk's buffer is freed as soon as it has been copied.  A count
+// sink's chunks only count, so they have no buffers.
+//
+// Returns the index of the section's closing op.
+size_t
+render_list_parallel(struct exec *x, size_t push, int *rval)
+{
+	struct frame	*f = x->frame + x->sections_n;
+	struct chunk	*c = 0;
+	size_t		close = x->prog->ops[push].jump;
+	const jsonoff_t	*next = x->ctx[x->sections_n].doc->next;
+	size_t		n = f->n / PAR_MIN_ELEMENTS;
+	size_t		e = f->elem;
+	size_t		total = 0;
+	size_t		i = 0;
+	size_t		k = 0;
+
+	if (n > (size_t) x->threads)
+		n = x->threads;
+
+	if ((c = arena_alloc(&x->arena, n * sizeof(*c))) == NULL) {
+		*rval = ENOMEM;
+		return close;
+	}
+
+	for (k = 0; k < n; k++) {
+		c[k].parent = x;
+		c[k].lo = f->n * k / n;
+		c[k].hi = f->n * (k + 1) / n;
+		c[k].close = close;
+		for (; i < c[k].lo; i++)
+			e = next[e];
+		c[k].first = e;
+		SLIST_INSERT_HEAD(&x->held, c + k, link);
+	}
+
+	// This thread takes the first chunk.  If a thread can't be
+	// started, its chunk is rendered here too.
+	for (k = 1; k < n; k++)
+		c[k].started = !pthread_create(&c[k].tid, 0, render_chunk, c + k);
+
+	render_chunk(c);
+
+	for (k = 1; k < n; k++) {
+		if (c[k].started)
+			pthread_join(c[k].tid, 0);
+		else
+			render_chunk(c + k);
+	}
+
+	for (k = 1; k < n; k++)
+		total += c[k].b.len;
+
+	if (x->out->type == buf_sink)
+		*rval = buf_grow(x->out->buf, total);
+
+	for (k = 0; !*rval && k < n; k++) {
+		*rval = c[k].rval;
+		// A count sink only reads the length.
+		if (!*rval)
+			*rval = sink_literal(x->out, c[k].b.data, c[k].b.len);
+		if (x->out->type != fd_sink) {
+			free(c[k].b.data);
+			c[k].b.data = 0;
+		}
+	}
+
+	// The last element has been done; the pop just closes the section.
+	f->n = 0;
+
+	return close;
+}
+
+// Execute ops[from] up to (not including) ops[to],
+// along with the bodies of any partials they call.
+int
+run_ops(struct exec *x, size_t from, size_t to)
+{
+	const struct op	*op = 0;
+	struct frame	*f = 0;
+	struct call	*c = 0;
+	char		*name = 0;
+	int		base = x->calls_n;
+	int		falsey = 0;
+	int		rval = 0;
+
+	// A call made here jumps to a body past the end of the template,
+	// so the run goes on, whatever to is, until it has returned.
+	for (size_t i = from; !rval && (i < to || x->calls_n > base); i++) {
+
+		op = x->prog->ops + i;
+		name = x->prog->text + op->offset;
+
+		switch (op->code) {
+
+		case op_literal:
+			rval = sink_literal(x->out, name, op->length);
+			break;
+
+		case op_escaped:
+			rval = insert_value(&x->objs, x->ctx, x->sections_n,
+				x->frame[x->sections_n].stamp, name, x->memo + op->slot, x->out, x->find_special, 0);
+			break;
+
+		case op_raw:
+			rval = insert_value(&x->objs, x->ctx, x->sections_n,
+				x->frame[x->sections_n].stamp, name, x->memo + op->slot, x->out, x->find_special, 1);
+			break;
+
+		case op_push:
+			if (!*name)
+				break;
+			// The compiler has checked the depth, but not
+			// what partials add to it.
+			if (x->sections_n >= MAX_SECTION_DEPTH - 1) {
+				rval = EX_TOO_MANY_SECTIONS;
+				break;
+			}
+			f = x->frame + ++x->sections_n;
+			rval = enter_section(&x->objs, x->ctx, x->sections_n,
+				f, name, x->memo + op->slot, &x->clock, &falsey);
+			f->start = i + 1;
+			// Straight on to the pop, which closes the section.
+			if (falsey)
+				i = op->jump - 1;
+			else if (!rval && x->threads > 1 && f->n >= 2 * PAR_MIN_ELEMENTS)
+				i = render_list_parallel(x, i, &rval) - 1;
+			break;
+
+		case op_invert:
+			if (!*name)
+				break;
+			if (x->sections_n >= MAX_SECTION_DEPTH - 1) {
+				rval = EX_TOO_MANY_SECTIONS;
+				break;
+			}
+			f = x->frame + ++x->sections_n;
+			f->n = 0;
+			f->stamp = f[-1].stamp;
+			find_section(&x->objs, x->ctx, x->sections_n, f->stamp,
+				name, x->memo + op->slot);
+			if (!section_falsey(x->ctx + x->sections_n))
+				i = op->jump - 1;
+
+				/*
+				 * The body is run once, in its parent's
+				 * context.
+				 */
+
+			x->ctx[x->sections_n] = x->ctx[x->sections_n - 1];
+			break;
+
+		case op_pop:
+			if (!*name)
+				break;
+			f = x->frame + x->sections_n;
+			if (f->n && ++f->i < f->n) {
+				f->elem = x->ctx[x->sections_n].doc->next[f->elem];
+				enter_element(f, x->ctx + x->sections_n, &x->clock);
+				i = f->start - 1;
+				break;
+			}
+			x->sections_n--;
+			break;
+
+		case op_call:
+			if (x->calls_n == MAX_PARTIAL_DEPTH) {
+				rval = EX_PARTIAL_TOO_DEEP;
+				break;
+			}
+			c = x->calls + x->calls_n++;
+			c->ret = i;
+			c->stamp = x->frame[x->sections_n].stamp;
+
+				/*
+				 * The body's tags have the same memo slots
+				 * at every call, so what they resolved to
+				 * at another one must not count here.
+				 */
+
+			x->frame[x->sections_n].stamp = ++x->clock;
+			i = op->jump - 1;
+			break;
+
+		case op_return:
+			// The end of the template, or of a partial's body.
+			if (x->calls_n == base) {
+				i = to - 1;
+				break;
+			}
+			c = x->calls + --x->calls_n;
+			x->frame[x->sections_n].stamp = c->stamp;
+			i = c->ret;
+			break;
+
+		}
+	}
+
+	return rval;
+}
+
+// Run a compiled template against some JSON,
+// sending the output to the given sink.
+//
+// Only the program's instructions are executed;
+// the template text is never rescanned.
+//
+// The parsed JSON and the memo table are scratch for this render
+// only, so they come from one arena that is released at the end.
+//
+// The section stack is ctx[], which holds each open section's
+// resolved value, so a push or pop is O(1) and a tag is looked up
+// from there instead of from the root.  (The compiler has already
+// checked that sections nest properly.)
+// A section over a list runs its body once per element: when its
+// pop is reached and elements remain, execution jumps back to the
+// op after the push.  A false or empty section jumps from its push
+// straight to its pop (see link_sections()), so nothing inside
+// it is looked at.
+//
+// If prog->threads is more than one, a list of at least
+// 2 * PAR_MIN_ELEMENTS elements is split across that many threads
+// (see render_list_parallel()).
+//
+// x is cleared, except for its arena, which the caller owns
+// and should reset or free afterwards.
+int
+execute_in(struct exec *x, const struct program *prog, const char *json, size_t jsonlen,
+		struct sink *out)
+{
+	struct arena	arena = x->arena;
+	struct chunk	*c = 0;
+	struct jsondoc	doc = {0};
+	int		rval = 0;
+
+	memset(x, 0, sizeof(*x));
+	x->arena = arena;
+	x->objs.arena = &x->arena;
+	x->prog = prog;
+	x->out = out;
+	x->threads = prog->threads;
+	x->find_special = find_special_kernel();
+	x->clock = 1;
+	SLIST_INIT(&x->held);
+
+	// Parse the JSON once; every lookup below shares the tape.
+	rval = parsedoc(json, json ? jsonlen : 0, &x->arena, &doc);
+
+	doc_root(&doc, x->ctx);
+	x->frame[0].stamp = x->clock;
+
+	// One memo slot per (section path, tag) in the template.
+	if (!rval && (x->memo = arena_alloc(&x->arena, (prog->slots_n + 1) * sizeof(*x->memo))) == NULL)
+		rval = ENOMEM;
+
+	if (!rval)
+		rval = run_ops(x, 0, prog->ops_n);
+
+	if (!rval)
+		rval = sink_flush(out);
+
+	SLIST_FOREACH(c, &x->held, link)
+		free(c->b.data);
+
+	return rval;
+}
+
+// execute_in() with state of its own, freed afterwards.
+int
+execute(const struct program *prog, const char *json, size_t jsonlen, struct sink *out)
+{
+	struct exec	*x = 0;
+	int		rval = 0;
+
+	// The state is too big to want on the stack.
+	if ((x = calloc(1, sizeof(*x))) == NULL)
+		return ENOMEM;
+
+	rval = execute_in(x, prog, json, jsonlen, out);
+
+	arena_free(&x->arena);
+	free(x);
+
+	return rval;
+}
+
+// Given a compiled template and some JSON, render the HTML.
+//
+// The output buffer is sized from the program's size hint,
+// which is the length of the last page rendered from it (plus a little
+// slack), so for templates that render pages of a similar size
+// each render costs one allocation and no reallocs.
+// A caller who knows better can set prog->sizehint before rendering.
+int
+render_compiled(struct program *prog, char *json, char **html)
+{
+	return render_compiled_len(prog, json, json ? strlen(json) : 0, html);
+}
+
+// render_compiled() for the jsonlen bytes at json,
+// which need not be NUL-terminated.
+int
+render_compiled_len(struct program *prog, const char *json, size_t jsonlen, char **html)
+{
+	struct buf	b = {0};
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!prog || !html)
+		return EX_LOGIC_ERROR;
+
+	*html = 0;
+
+	// Allocate memory to hold HTML.
+	rval = buf_init(&b, prog->sizehint + prog->sizehint / 8);
+
+	out.type = buf_sink;
+	out.buf = &b;
+
+	if (!rval)
+		rval = execute(prog, json, jsonlen, &out);
+
+	if (!rval)
+		prog->sizehint = b.len;
+
+	*html = b.data;
+
+	return rval;
+}
+
+// Render a compiled template, handing the output to a write callback
+// as it is produced.
+//
+// Literal spans and values are passed to write(arg, s, len)
+// one at a time and in order; s is only valid during the call.
+// Nothing is buffered, so the first bytes go out right away
+// and memory use does not depend on the size of the page.
+// If write returns non-zero, rendering stops and that value is returned.
+int
+render_to_sink(const struct program *prog, char *json, sink_write_fn write, void *arg)
+{
+	return render_to_sink_len(prog, json, json ? strlen(json) : 0, write, arg);
+}
+
+int
+render_to_sink_len(const struct program *prog, const char *json, size_t jsonlen,
+		sink_write_fn write, void *arg)
+{
+	struct sink	out = {0};
+
+	if (!prog || !write)
+		return EX_LOGIC_ERROR;
+
+	out.type = callback_sink;
+	out.write = write;
+	out.arg = arg;
+
+	return execute(prog, json, jsonlen, &out);
+}
+
+// Render a compiled template straight to a file descriptor.
+//
+// Output is gathered into batches of up to SINK_IOV_N spans and written
+// with writev().  Literal text is sent from the program, and values
+// from the JSON, without copying either.
+// Returns errno if a write fails.
+int
+render_to_fd(const struct program *prog, char *json, int fd)
+{
+	return render_to_fd_len(prog, json, json ? strlen(json) : 0, fd);
+}
+
+int
+render_to_fd_len(const struct program *prog, const char *json, size_t jsonlen, int fd)
+{
+	struct sink	out = {0};
+
+	if (!prog || fd < 0)
+		return EX_LOGIC_ERROR;
+
+	out.type = fd_sink;
+	out.fd = fd;
+
+	return execute(prog, json, jsonlen, &out);
+}
+
+// Work out exactly how many bytes a compiled template renders to
+// against some JSON, without making them.
+//
+// This is a render like any other, through the same lookups and the
+// same escaping, into a sink that only counts, so the length is exact.
+// A buffer of that size can then be filled by render_into(),
+// with no slack and no reallocs.
+int
+render_measure(const struct program *prog, char *json, size_t *len)
+{
+	return render_measure_len(prog, json, json ? strlen(json) : 0, len);
+}
+
+int
+render_measure_len(const struct program *prog, const char *json, size_t jsonlen,
+		size_t *len)
+{
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!prog || !len)
+		return EX_LOGIC_ERROR;
+
+	out.type = count_sink;
+
+	rval = execute(prog, json, jsonlen, &out);
+
+	*len = out.len;
+
+	return rval;
+}
+
+// Render a compiled template into the size bytes at html, which
+// the caller owns, and set \*len to the number of bytes written.
+// No NUL is added.
+//
+// Returns EX_OUTPUT_TOO_LONG if the output doesn't fit; what did
+// fit is left in html.
+int
+render_into(const struct program *prog, char *json, char *html, size_t size, size_t *len)
+{
+	return render_into_len(prog, json, json ? strlen(json) : 0, html, size, len);
+}
+
+int
+render_into_len(const struct program *prog, const char *json, size_t jsonlen,
+		char *html, size_t size, size_t *len)
+{
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!prog || (!html && size) || !len)
+		return EX_LOGIC_ERROR;
+
+	out.type = mem_sink;
+	out.mem = html;
+	out.size = size;
+
+	rval = execute(prog, json, jsonlen, &out);
+
+	*len = out.len;
+
+	return rval;
+}
+
+// Given a mustache template and some JSON, render the HTML.
+//
+// This compiles the template, renders it once and throws the program away.
+// Callers that render the same template repeatedly should
+// call compile_template() once and render_compiled() for each render.
+int
+render(const char *template, char *json, char **html)
+{
+	return render_len(template, template ? strlen(template) : 0,
+		json, json ? strlen(json) : 0, html);
+}
+
+// render() for a template and JSON given as (pointer, length) pairs,
+// neither of which need be NUL-terminated.  The HTML still is.
+int
+render_len(const char *template, size_t templatelen, const char *json, size_t jsonlen,
+		char **html)
+{
+	struct program	*prog = 0;
+	int		rval = 0;
+
+	if (html)
+		*html = 0;
+
+	rval = compile_template_len(template, templatelen, &prog);
+
+	if (!rval)
+		rval = render_compiled_len(prog, json, jsonlen, html);
+
+	free_program(prog);
+
+	return rval;
+}
+
+// A render context: the state one thread needs to render.
+//
+// Everything a render writes lives here (the section stacks, the
+// memo table, the arena the JSON is parsed into and the output
+// buffer), so any number of threads can render the same compiled
+// program at once, each with its own context and without locks.
+// The program is only read.
+//
+// A context keeps its memory between renders: once it has seen a
+// page of a given size, rendering another one like it allocates
+// nothing.  A context is not safe to share between threads.
+struct mustache_ctx {
+	struct exec	x;
+	struct buf	b;
+	size_t		sizehint;
+};
+
+// Make a render context.  Returns NULL if out of memory.
+struct mustache_ctx *
+mustache_ctx_new(void)
+{
+	return calloc(1, sizeof(struct mustache_ctx));
+}
+
+void
+mustache_ctx_free(struct mustache_ctx *ctx)
+{
+	if (ctx) {
+		arena_free(&ctx->x.arena);
+		free(ctx->b.data);
+		free(ctx);
+	}
+}
+
+// Render a compiled program into the context's output buffer.
+//
+// On success \*html points to the NUL-terminated page, and \*len
+// (if len is not NULL) is its length.  The page belongs to the
+// context and is good until the next render with it, or until
+// mustache_ctx_free().
+int
+mustache_render(struct mustache_ctx *ctx, const struct program *prog, char *json,
+		const char **html, size_t *len)
+{
+	return mustache_render_len(ctx, prog, json, json ? strlen(json) : 0, html, len);
+}
+
+// mustache_render() for the jsonlen bytes at json,
+// which need not be NUL-terminated.
+int
+mustache_render_len(struct mustache_ctx *ctx, const struct program *prog,
+		const char *json, size_t jsonlen, const char **html, size_t *len)
+{
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!ctx || !prog || !html)
+		return EX_LOGIC_ERROR;
+
+	*html = 0;
+
+	if (!ctx->b.data)
+		rval = buf_init(&ctx->b, ctx->sizehint);
+	else {
+		ctx->b.len = 0;
+		ctx->b.data[0] = '\0';
+	}
+
+	out.type = buf_sink;
+	out.buf = &ctx->b;
+
+	if (!rval)
+		rval = execute_in(&ctx->x, prog, json, jsonlen, &out);
+
+	arena_reset(&ctx->x.arena);
+
+	if (!rval) {
+		ctx->sizehint = ctx->b.len;
+		*html = ctx->b.data;
+		if (len)
+			*len = ctx->b.len;
+	}
+
+	return rval;
+}
+
+// Like render_to_sink(), but with a context's memory.
+int
+mustache_render_to_sink(struct mustache_ctx *ctx, const struct program *prog, char *json,
+		sink_write_fn write, void *arg)
+{
+	return mustache_render_to_sink_len(ctx, prog, json, json ? strlen(json) : 0, write, arg);
+}
+
+int
+mustache_render_to_sink_len(struct mustache_ctx *ctx, const struct program *prog,
+		const char *json, size_t jsonlen, sink_write_fn write, void *arg)
+{
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!ctx || !prog || !write)
+		return EX_LOGIC_ERROR;
+
+	out.type = callback_sink;
+	out.write = write;
+	out.arg = arg;
+
+	rval = execute_in(&ctx->x, prog, json, jsonlen, &out);
+	arena_reset(&ctx->x.arena);
+
+	return rval;
+}
+
+// Like render_to_fd(), but with a context's memory.
+int
+mustache_render_to_fd(struct mustache_ctx *ctx, const struct program *prog, char *json, int fd)
+{
+	return mustache_render_to_fd_len(ctx, prog, json, json ? strlen(json) : 0, fd);
+}
+
+int
+mustache_render_to_fd_len(struct mustache_ctx *ctx, const struct program *prog,
+		const char *json, size_t jsonlen, int fd)
+{
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!ctx || !prog || fd < 0)
+		return EX_LOGIC_ERROR;
+
+	out.type = fd_sink;
+	out.fd = fd;
+
+	rval = execute_in(&ctx->x, prog, json, jsonlen, &out);
+	arena_reset(&ctx->x.arena);
+
+	return rval;
+}
+
+// Map a file into memory, read-only.
+//
+// The pages are shared with the page cache (and with any other
+// process that maps the file), so nothing is read or copied up
+// front.  An empty file gives an empty mapping.
+// Returns errno if the file can't be opened or mapped.
+int
+map_file(const char *path, struct mapfile *m)
+{
+	struct stat	st;
+	void		*p = 0;
+	int		fd = -1;
+	int		rval = 0;
+
+	if (!path || !m)
+		return EX_LOGIC_ERROR;
 
-	l_no_xtag:
-		rval = add_to_tag(&qtag, tag, prev);
-		if (!rval)
-			rval = add_to_tag(&qtag, tag, *cur);
-		go = gotag;
-		debug_printf("\t\t--> %s (%s)\n", "gotag", "l_no_xtag");
-		goto l_loop;
+	m->p = "";
+	m->len = 0;
 
-	l_yes_xtag:
-		go = gohtml;
-		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xtag");
-		debug_printf("before insert, html = \"%s\"\n", *html);
-		if (!drop)
-			rval = insert_value(section, sections_n, tag, &qhtml, json, 0);
-		debug_printf("after insert, html = \"%s\"\n", *html);
-		memset(tag, 0, MAX_KEYSZ);
-		goto l_loop;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return errno;
 
-	l_xrawpp:
-		go = goxrawpp;
-		debug_printf("\t\t--> %s (%s)\n", "goxrawpp", "l_xrawpp");
-		goto l_loop;
+	if (fstat(fd, &st) < 0)
+		rval = errno;
+	else if ((uintmax_t) st.st_size > SIZE_MAX)
+		rval = EFBIG;
 
-	l_no_xrawp:
-		rval = add_to_tag(&qtag, tag, prev);
-		if (!rval)
-			rval = add_to_tag(&qtag, tag, *cur);
-		go = gorawtag;
-		debug_printf("\t\t--> %s (%s)\n", "gorawtag", "l_no_xrawp");
-		goto l_loop;
+	if (!rval && st.st_size > 0) {
+		p = mmap(0, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			rval = errno;
+		else {
+			m->p = p;
+			m->len = (size_t) st.st_size;
+		}
+	}
 
-	l_yes_xrawp:
-		go = goxrawp;
-		debug_printf("\t\t--> %s (%s)\n", "goxrawp", "l_yes_xrawp");
-		goto l_loop;
+	close(fd);
 
-	l_no_xraw:
-		rval = add_to_tag(&qtag, tag, prevprev);;
-		if (!rval)
-			rval = add_to_tag(&qtag, tag, prev);
-		if (!rval)
-			rval = add_to_tag(&qtag, tag, *cur);
-		go = gorawtag;
-		debug_printf("\t\t--> %s (%s)\n", "gorawtag", "l_no_xraw");
-		goto l_loop;
+	return rval;
+}
 
-	l_yes_xraw:
-		go = gohtml;
-		debug_printf("\t\t--> %s (%s)\n", "gohtml", "l_yes_xraw");
-		debug_printf("before insert raw, html = \"%s\"\n", *html);
-		if (!drop)
-			rval = insert_value(section, sections_n, tag, &qhtml, json, 1);
-		debug_printf("after insert raw, html = \"%s\"\n", *html);
-		memset(tag, 0, MAX_KEYSZ);
-		goto l_loop;
+void
+unmap_file(struct mapfile *m)
+{
+	if (m && m->len)
+		munmap((void *) m->p, m->len);
+	if (m) {
+		m->p = "";
+		m->len = 0;
+	}
+}
+
+// Compile the template in a file.
+// The program keeps its own copy of what it needs,
+// so the file is unmapped before this returns.
+int
+compile_file(const char *path, struct program **progp)
+{
+	struct mapfile	m = {0};
+	int		rval = 0;
+
+	rval = map_file(path, &m);
+
+	if (!rval)
+		rval = compile_template_len(m.p, m.len, progp);
+
+	unmap_file(&m);
+
+	return rval;
+}
+
+// Render with the JSON context in a file, straight to a file descriptor.
+//
+// Values go from the mapped context to writev() without being copied,
+// so a context of any size costs no more memory than its parse.
+int
+render_file_to_fd(const struct program *prog, const char *json_path, int fd)
+{
+	struct mapfile	m = {0};
+	struct sink	out = {0};
+	int		rval = 0;
+
+	if (!prog || fd < 0)
+		return EX_LOGIC_ERROR;
+
+	out.type = fd_sink;
+	out.fd = fd;
+
+	rval = map_file(json_path, &m);
+
+	if (!rval)
+		rval = execute(prog, m.p, m.len, &out);
+
+	unmap_file(&m);
+
+	return rval;
+}
+
+// mustache_render() with the JSON context in a file.
+// The page is in the context's buffer, as for mustache_render().
+int
+mustache_render_file(struct mustache_ctx *ctx, const struct program *prog,
+		const char *json_path, const char **html, size_t *len)
+{
+	struct mapfile	m = {0};
+	int		rval = 0;
+
+	rval = map_file(json_path, &m);
+
+	if (!rval)
+		rval = mustache_render_len(ctx, prog, m.p, m.len, html, len);
+
+	unmap_file(&m);
+
+	return rval;
+}
+
+		/*
+		 * The template cache.
+		 *
+		 * Compiled programs are kept in a hash table, keyed by
+		 * the template's text or by its path, with the most
+		 * recently used at the head of a list.  When the programs
+		 * take more than the budget, the least recently used are
+		 * dropped.  One mutex covers the table, the list and the
+		 * counters; templates are compiled outside it.  A render
+		 * holds its entry, so one that is evicted mid-render is
+		 * only freed when the render gives it back.
+		 */
+
+		/*
+		 * Hashing a template.
+		 *
+		 * Every hit hashes the whole template, so the hash is
+		 * taken 64 bytes at a time in eight lanes.  Each word's
+		 * high half is multiplied by its low half into its lane,
+		 * and the word itself is added to its neighbour (as XXH3
+		 * does), so no multiply waits on another, and the lanes
+		 * map onto 32-bit vector multiplies.  The SSE2 and AVX2
+		 * kernels give the same hashes as the scalar one.
+		 */
+
+#define HASH_LANES	8
+
+typedef void (*hash_fn)(const char *p, size_t n, uint64_t acc[HASH_LANES]);
+
+const uint64_t hash_keys[HASH_LANES] = {
+	0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL, 0x165667b19e3779f9ULL, 0x85ebca77c2b2ae63ULL,
+	0x27d4eb2f165667c5ULL, 0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL, 0x94d049bb133111ebULL
+};
+
+// Fold the n bytes at p, a multiple of 64, into acc.
+void
+hash_blocks_scalar(const char *p, size_t n, uint64_t acc[HASH_LANES])
+{
+	uint64_t	a[HASH_LANES];
+	uint64_t	w[HASH_LANES];
+	uint64_t	x = 0;
+
+	// In locals, so the lanes stay in registers.
+	memcpy(a, acc, sizeof(a));
+
+	for (; n >= 64; p += 64, n -= 64) {
+		memcpy(w, p, 64);
+		for (int k = 0; k < HASH_LANES; k++) {
+			x = w[k] ^ hash_keys[k];
+			a[k] += (x & 0xffffffff) * (x >> 32) + w[k ^ 1];
+		}
+	}
+
+	memcpy(acc, a, sizeof(a));
+}
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+void
+hash_blocks_sse2(const char *p, size_t n, uint64_t acc[HASH_LANES])
+{
+	__m128i		k[4], a[4], w, x;
+
+	for (int i = 0; i < 4; i++) {
+		k[i] = _mm_loadu_si128((const __m128i *) (hash_keys + 2 * i));
+		a[i] = _mm_loadu_si128((const __m128i *) (acc + 2 * i));
+	}
+
+	for (; n >= 64; p += 64, n -= 64) {
+		for (int i = 0; i < 4; i++) {
+			w = _mm_loadu_si128((const __m128i *) (p + 16 * i));
+			x = _mm_xor_si128(w, k[i]);
+			a[i] = _mm_add_epi64(a[i], _mm_add_epi64(
+				_mm_mul_epu32(x, _mm_srli_epi64(x, 32)),
+				_mm_shuffle_epi32(w, 0x4e)));
+		}
+	}
+
+	for (int i = 0; i < 4; i++)
+		_mm_storeu_si128((__m128i *) (acc + 2 * i), a[i]);
+}
+
+__attribute__((target("avx2")))
+void
+hash_blocks_avx2(const char *p, size_t n, uint64_t acc[HASH_LANES])
+{
+	const __m256i	k0 = _mm256_loadu_si256((const __m256i *) hash_keys);
+	const __m256i	k1 = _mm256_loadu_si256((const __m256i *) (hash_keys + 4));
+	__m256i		a0 = _mm256_loadu_si256((const __m256i *) acc);
+	__m256i		a1 = _mm256_loadu_si256((const __m256i *) (acc + 4));
+	__m256i		w0, w1, x0, x1;
+
+	for (; n >= 64; p += 64, n -= 64) {
+		w0 = _mm256_loadu_si256((const __m256i *) p);
+		w1 = _mm256_loadu_si256((const __m256i *) (p + 32));
+		x0 = _mm256_xor_si256(w0, k0);
+		x1 = _mm256_xor_si256(w1, k1);
+		// 0x4e swaps each pair of words, for w[k ^ 1].
+		a0 = _mm256_add_epi64(a0, _mm256_add_epi64(
+			_mm256_mul_epu32(x0, _mm256_srli_epi64(x0, 32)),
+			_mm256_shuffle_epi32(w0, 0x4e)));
+		a1 = _mm256_add_epi64(a1, _mm256_add_epi64(
+			_mm256_mul_epu32(x1, _mm256_srli_epi64(x1, 32)),
+			_mm256_shuffle_epi32(w1, 0x4e)));
+	}
 
+	_mm256_storeu_si256((__m256i *) acc, a0);
+	_mm256_storeu_si256((__m256i *) (acc + 4), a1);
+}
+
+#endif
+
+hash_fn
+hash_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	if (__builtin_cpu_supports("avx2"))
+		return hash_blocks_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return hash_blocks_sse2;
+#endif
+	return hash_blocks_scalar;
+}
+
+// Hash a template (or a path), with blocks as the kernel for
+// its whole 64-byte blocks.
+unsigned long
+contenthash(hash_fn blocks, const char *p, size_t len)
+{
+	uint64_t	acc[HASH_LANES] = { len, 1, 2, 3, 4, 5, 6, 7 };
+	uint64_t	h = 0;
+	uint64_t	w = 0;
+	size_t		i = len & ~(size_t) 63;
+
+	blocks(p, i, acc);
+
+	for (int k = 0; k < HASH_LANES; k++) {
+		h = (h ^ acc[k]) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+
+	for (; len - i >= 8; i += 8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+
+	w = 0;
+	memcpy(&w, p + i, len - i);
+	h = (h ^ w) * 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 29;
+
+	return (unsigned long) h;
+}
+
+// A compiled template in the cache.
+// A template's text is kept at the start of its program's text
+// (see rebase_text()); only a path is kept on its own.
+struct cacheent {
+	char		*key;		// the path, for a file
+	size_t		keylen;
+	unsigned long	hash;
+	int		isfile;
+	struct stat	st;		// for a file, what it was compiled from
+	struct program	*prog;
+	size_t		bytes;		// what it counts against the budget
+	int		refs;
+	int		dead;		// evicted, but still held
+	LIST_ENTRY(cacheent) chain;
+	TAILQ_ENTRY(cacheent) lru;
+};
+
+LIST_HEAD(cachebucket, cacheent);
+
+struct mustache_cache {
+	pthread_mutex_t	lock;
+	struct cachebucket *buckets;
+	size_t		nbuckets;
+	TAILQ_HEAD(cachelru, cacheent) lru;	// most recently used first
+	size_t		budget;
+	hash_fn		hash;
+	struct mustache_cache_stats st;
+};
+
+// Make a template cache that keeps up to budget bytes of compiled
+// templates, or any amount if budget is 0.
+// Returns NULL if out of memory.
+struct mustache_cache *
+mustache_cache_new(size_t budget)
+{
+	struct mustache_cache *c = 0;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+
+	c->nbuckets = 64;
+	if ((c->buckets = calloc(c->nbuckets, sizeof(*c->buckets))) == NULL
+	    || pthread_mutex_init(&c->lock, 0)) {
+		free(c->buckets);
+		free(c);
+		return NULL;
+	}
+
+	TAILQ_INIT(&c->lru);
+	c->budget = budget;
+	c->hash = hash_kernel();
+
+	return c;
+}
+
+void
+cacheent_free(struct cacheent *e)
+{
+	free_program(e->prog);
+	free(e->key);
+	free(e);
+}
+
+// Free a cache and everything in it.
+// No render may be using it.
+void
+mustache_cache_free(struct mustache_cache *c)
+{
+	struct cacheent	*e = 0;
+
+	if (!c)
+		return;
+
+	while ((e = TAILQ_FIRST(&c->lru)) != NULL) {
+		TAILQ_REMOVE(&c->lru, e, lru);
+		cacheent_free(e);
+	}
+
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c);
+}
+
+// A copy of the cache's counters.
+void
+mustache_cache_stats(struct mustache_cache *c, struct mustache_cache_stats *st)
+{
+	pthread_mutex_lock(&c->lock);
+	*st = c->st;
+	pthread_mutex_unlock(&c->lock);
+}
+
+// What an entry is keyed on: its path, or its template's text.
+const char *
+cache_key(const struct cacheent *e)
+{
+	return e->isfile ? e->key : e->prog->text;
+}
+
+// Find the entry for a key with hash h, going by the hash and the
+// length alone; the caller compares the keys themselves.
+// Called with the lock held.
+struct cacheent *
+cache_find(struct mustache_cache *c, size_t keylen, int isfile, unsigned long h)
+{
+	struct cacheent	*e = 0;
+
+	LIST_FOREACH(e, c->buckets + (h & (c->nbuckets - 1)), chain)
+		if (e->hash == h && e->isfile == isfile && e->keylen == keylen)
+			return e;
+
+	return NULL;
+}
+
+// Take an entry out of the cache, freeing it unless a render
+// still holds it.  Called with the lock held.
+void
+cache_unlink(struct mustache_cache *c, struct cacheent *e)
+{
+	LIST_REMOVE(e, chain);
+	TAILQ_REMOVE(&c->lru, e, lru);
+	c->st.entries--;
+	c->st.bytes -= e->bytes;
+
+	if (e->refs)
+		e->dead = 1;
+	else
+		cacheent_free(e);
+}
+
+// Add a new entry, in place of any other with the same key,
+// and evict from the tail of the list until the cache is within
+// its budget.  An entry bigger than the whole budget is not kept:
+// it is freed once the render that compiled it is done.
+// Called with the lock held.
+void
+cache_insert(struct mustache_cache *c, struct cacheent *e)
+{
+	struct cachebucket *b = 0;
+	struct cacheent	*old = 0;
+	size_t		sz = 0;
+
+	if (c->budget && e->bytes > c->budget) {
+		e->dead = 1;
+		return;
+	}
+
+	if ((old = cache_find(c, e->keylen, e->isfile, e->hash)) != NULL)
+		cache_unlink(c, old);
+
+	// Keep the chains short; if the table can't grow, they get longer.
+	if (c->st.entries >= c->nbuckets
+	    && (b = calloc(sz = c->nbuckets * 2, sizeof(*b))) != NULL) {
+		TAILQ_FOREACH(old, &c->lru, lru)
+			LIST_INSERT_HEAD(b + (old->hash & (sz - 1)), old, chain);
+		free(c->buckets);
+		c->buckets = b;
+		c->nbuckets = sz;
+	}
+
+	LIST_INSERT_HEAD(c->buckets + (e->hash & (c->nbuckets - 1)), e, chain);
+	TAILQ_INSERT_HEAD(&c->lru, e, lru);
+	c->st.entries++;
+	c->st.bytes += e->bytes;
+
+	while (c->budget && c->st.bytes > c->budget
+	    && (old = TAILQ_LAST(&c->lru, cachelru)) != e) {
+		cache_unlink(c, old);
+		c->st.evictions++;
+	}
+}
+
+// Whether a file is still the one an entry was compiled from.
+// A file rewritten in the same second with the same size
+// is not noticed.
+int
+same_file(const struct stat *a, const struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino
+		&& a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+// Find the program for a template (keyed by its text) or a template
+// file (keyed by its path, and recompiled if the file has changed),
+// compiling it and adding it to the cache if it is not there.
+//
+// Under the lock, an entry is only found by its hash and held.
+// Its key is compared after the lock is released, so threads
+// rendering big templates don't queue behind each other's compares.
+// One that turns out not to match (a changed file, or a hash that
+// collides) is dropped, and the lookup counts as a miss.
+//
+// The entry is held until cache_release().
+int
+cache_acquire(struct mustache_cache *c, const char *key, size_t keylen, int isfile,
+		struct cacheent **ep)
+{
+	struct cacheent	*e = 0;
+	struct stat	st = {0};
+	unsigned long	h = contenthash(c->hash, key, keylen) ^ isfile;
+	int		rval = 0;
+
+	if (isfile && stat(key, &st) < 0)
+		return errno;
+
+	pthread_mutex_lock(&c->lock);
+
+	if ((e = cache_find(c, keylen, isfile, h)) != NULL) {
+		e->refs++;
+		TAILQ_REMOVE(&c->lru, e, lru);
+		TAILQ_INSERT_HEAD(&c->lru, e, lru);
+		c->st.hits++;
+	} else
+		c->st.misses++;
+
+	pthread_mutex_unlock(&c->lock);
+
+	if (e && (memcmp(cache_key(e), key, keylen)
+	    || (isfile && !same_file(&e->st, &st)))) {
+		pthread_mutex_lock(&c->lock);
+		c->st.hits--;
+		c->st.misses++;
+		if (!e->dead)
+			cache_unlink(c, e);
+		if (!--e->refs && e->dead)
+			cacheent_free(e);
+		pthread_mutex_unlock(&c->lock);
+		e = 0;
+	}
+
+	if (e) {
+		*ep = e;
+		return 0;
+	}
+
+	if ((e = calloc(1, sizeof(*e))) == NULL
+	    || (isfile && (e->key = malloc(keylen + 1)) == NULL)) {
+		free(e);
+		return ENOMEM;
+	}
+
+	if (isfile) {
+		memcpy(e->key, key, keylen);
+		e->key[keylen] = '\0';
+	}
+	e->keylen = keylen;
+	e->hash = h;
+	e->isfile = isfile;
+	e->st = st;
+	e->refs = 1;
+
+	if (isfile)
+		rval = compile_file(e->key, &e->prog);
+	else
+		rval = compile_template_len(key, keylen, &e->prog);
+
+	if (!rval && !isfile)
+		rval = rebase_text(e->prog, key, keylen);
+
+	if (rval) {
+		free_program(e->prog);
+		free(e->key);
+		free(e);
+		return rval;
+	}
+
+	e->bytes = sizeof(*e) + (isfile ? keylen + 1 : 0) + sizeof(*e->prog)
+		+ e->prog->textsz + e->prog->opssz * sizeof(*e->prog->ops);
+
+	pthread_mutex_lock(&c->lock);
+	cache_insert(c, e);
+	pthread_mutex_unlock(&c->lock);
+
+	*ep = e;
+
+	return 0;
+}
+
+void
+cache_release(struct mustache_cache *c, struct cacheent *e)
+{
+	pthread_mutex_lock(&c->lock);
+	if (!--e->refs && e->dead)
+		cacheent_free(e);
+	pthread_mutex_unlock(&c->lock);
+}
+
+// mustache_render_len() with the templatelen bytes at template,
+// compiled once and kept in a cache.
+//
+// Once a template is in the cache, rendering it again costs a hash
+// and a compare of its text, and it is never lexed again.
+// Any number of threads may share one cache, each with its own ctx.
+int
+mustache_render_cached(struct mustache_ctx *ctx, struct mustache_cache *cache,
+		const char *template, size_t templatelen, const char *json, size_t jsonlen,
+		const char **html, size_t *len)
+{
+	struct cacheent	*e = 0;
+	int		rval = 0;
+
+	if (!cache || !template)
+		return EX_LOGIC_ERROR;
+
+	rval = cache_acquire(cache, template, templatelen, 0, &e);
+
+	if (!rval) {
+		rval = mustache_render_len(ctx, e->prog, json, jsonlen, html, len);
+		cache_release(cache, e);
+	}
+
+	return rval;
+}
+
+// mustache_render_cached() with the template in a file, kept in
+// the cache under its path.  The file is only stat()ed to see
+// whether it has changed since it was compiled.
+int
+mustache_render_cached_file(struct mustache_ctx *ctx, struct mustache_cache *cache,
+		const char *template_path, const char *json, size_t jsonlen,
+		const char **html, size_t *len)
+{
+	struct cacheent	*e = 0;
+	int		rval = 0;
+
+	if (!cache || !template_path)
+		return EX_LOGIC_ERROR;
+
+	rval = cache_acquire(cache, template_path, strlen(template_path), 1, &e);
+
+	if (!rval) {
+		rval = mustache_render_len(ctx, e->prog, json, jsonlen, html, len);
+		cache_release(cache, e);
+	}
+
+	return rval;
 }
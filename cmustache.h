@@ -1,4 +1,4 @@
-// Must include sys/queue.h before this.
+// Must include stddef.h, stdint.h and sys/queue.h before this.
 
 #define	EX_TAG_TOO_LONG				4201
 #define	EX_TOO_MANY_KEYVAL_PAIRS		4202
@@ -8,9 +8,13 @@
 #define	EX_POP_DOES_NOT_MATCH		4206
 #define	EX_INVALID_SECTION_NAME		4207
 #define	EX_TOO_MANY_SECTIONS		4208
+#define	EX_JSON_TOO_LARGE			4209
+#define	EX_PARTIAL_TOO_DEEP			4210
+#define	EX_OUTPUT_TOO_LONG			4211
 
 #define MAX_KEYSZ				1024
 #define MAX_SECTION_DEPTH		20
+#define MAX_PARTIAL_DEPTH		32
 
 enum jsontype {
 	string_type,
@@ -22,31 +26,388 @@ enum jsontype {
 	null_type
 };
 
-SLIST_HEAD(json, jsonpair);
+enum opcode {
+	op_literal,
+	op_escaped,
+	op_raw,
+	op_push,
+	op_pop,
+	op_invert,
+	op_call,
+	op_return
+};
+
+// One instruction of a compiled template.
+// The offset and length locate the literal text or the
+// (NUL-terminated) tag name in the program's text.
+// Value tags and section opens also carry their memo slot.
+// The jump of a section open is the op that closes it, and that
+// of a call of a recursive partial the op its body starts at.
+struct op {
+	enum opcode	code;
+	size_t		offset;
+	size_t		length;
+	int		slot;
+	size_t		jump;
+};
+
+// With threads above 1, a big list is rendered in chunks on that many
+// threads, each started for the list and joined at its end.  Only the
+// *_to_fd() calls write the chunks out as they are; every other call
+// copies them, in order, into its one output.
+struct program {
+	char		*text;
+	size_t		textlen;
+	size_t		textsz;
+	struct op	*ops;
+	size_t		ops_n;
+	size_t		opssz;
+	size_t		slots_n;	// distinct (section path, tag) pairs
+	size_t		sizehint;	// bytes output by the last render
+	int		threads;	// render big lists on this many threads
+};
+
+// Compile-time table that hands out small ids for (parent, name) pairs.
+struct internent {
+	unsigned long	hash;
+	int		used;
+	int		parent;
+	size_t		name;
+	int		id;
+};
+
+struct interntab {
+	struct internent *v;
+	size_t		sz;
+	size_t		n;
+};
+
+// Receives rendered output, len bytes at a time.
+// Return 0 to keep going, anything else to stop the render.
+typedef int (*sink_write_fn)(void *arg, const char *s, size_t len);
+
+// Finds a partial for the compiler: sets \*text and \*len to the
+// template of the one called name and returns 0,
+// or returns anything else if there is none.
+typedef int (*partial_fn)(void *arg, const char *name, const char **text, size_t *len);
+
+// A scanner: returns the first byte in [p, end) it is looking for, or end.
+typedef const char *(*scan_fn)(const char *p, const char *end);
+
+// What a classifier finds in 64 bytes of JSON, a bit per byte.
+struct jsonmasks {
+	uint64_t	quote;		// "
+	uint64_t	bslash;		// backslash
+	uint64_t	open;		// { [ ,
+	uint64_t	close;		// } ] :
+};
+
+typedef void (*classify_fn)(const char *p, struct jsonmasks *m);
+
+// The structural characters of a JSON text: bit i of bits[] is set
+// for each bracket, colon and comma outside a string, and for each
+// quote that opens or closes one.  seps counts the opening
+// brackets and commas.
+struct jsonstruct {
+	uint64_t	*bits;
+	size_t		words;
+	size_t		seps;
+};
+
+// A growable, NUL-terminated output buffer.
+struct buf {
+	char		*data;
+	size_t		len;
+	size_t		sz;
+};
+
+// A bump allocator for scratch memory that is all released at once.
+struct arenablk {
+	struct arenablk	*next;
+	size_t		sz;
+	size_t		used;
+	max_align_t	data[];
+};
+
+struct arena {
+	struct arenablk	*head;
+	size_t		blocks;		// malloc() calls made
+	size_t		allocs;		// allocations handed out
+};
+
+		/*
+		 * Offsets into a parsed JSON document are 32 bits wide,
+		 * which handles contexts up to 4 GB.
+		 * Build with -DJSON_OFF64 for bigger ones.
+		 */
+
+#ifdef JSON_OFF64
+typedef uint64_t	jsonoff_t;
+#define	JSONOFF_MAX		UINT64_MAX
+#else
+typedef uint32_t	jsonoff_t;
+#define	JSONOFF_MAX		UINT32_MAX
+#endif
+
+// The (offset, length) pairs for the keys and values in one JSON object
+// or array.  Entries are width bytes wide: 2 for documents under 64 KB,
+// 4 or 8 for bigger ones.  The array is zero-terminated.
+struct jsonindex {
+	int		width;
+	size_t		sz;
+	void		*v;
+	struct arena	*arena;		// where v came from, if not malloc()
+};
+
+// A JSON context parsed once by parsedoc(), as a tape: one entry
+// per value, in document order, each object or array followed by
+// the entries for everything in it.  Entry 0 is the whole document.
+//
+// The entries are kept as parallel arrays (type[i], key[i], ...)
+// in one allocation, so a search of an object's keys only reads
+// keylen[] and key[] until one matches.  Offsets are from the start
+// of json.
+//
+// Unlike a jsonindex, the tape does not narrow its entries for small
+// documents: they are always jsonoff_t wide, 25 bytes an entry in
+// all (13 if they were two bytes), so that every lookup indexes the
+// arrays directly rather than switching on a width.  next[i] is the entry after i and everything in it:
+// i's first child, if it has any, is i + 1, and its next sibling
+// is next[i].
+struct jsondoc {
+	const char	*json;
+	size_t		jsonlen;
+	struct arena	*arena;
+	size_t		n;
+	jsonoff_t	*key;		// members of objects only
+	jsonoff_t	*keylen;
+	jsonoff_t	*val;
+	jsonoff_t	*vallen;
+	jsonoff_t	*next;
+	jsonoff_t	*members;	// number of children
+	uint8_t		*type;		// enum jsontype
+};
+
+// A value in a parsed document: entry i of doc, whose text starts at p.
+// A doc of NULL means there is no value.
+struct jsonval {
+	const char		*p;
+	const struct jsondoc	*doc;
+	size_t			i;
+};
+
+// A piece of the JSON text: a resolved value.
+struct span {
+	const char	*p;
+	size_t		len;
+};
+
+// A render's hash indexes of the wide objects it searches,
+// found by the object's entry in the tape.
+struct objent {
+	size_t		obj;		// the entry, plus one; 0 if unused
+	unsigned int	searches;
+	jsonoff_t	*index;		// entries plus one, open-addressed by key hash
+	size_t		sz;
+};
+
+struct objcache {
+	struct objent	*v;
+	size_t		sz;
+	size_t		n;
+	struct arena	*arena;		// where the tables live
+};
+
+// What one (section path, tag) pair resolved to during a render,
+// and the stamp of its innermost section when it was resolved.
+// A stamp of 0 means not yet resolved.
+// For a section's own name, node is the tape entry it resolved to.
+struct memo {
+	unsigned long	stamp;
+	int		found;
+	struct span	v;
+	size_t		node;
+};
+
+// An open section during a render.  A section over a non-empty list
+// of n elements is on element i, which is entry elem of the tape.
+// The stamp changes whenever the section's value (or an enclosing
+// one) does.
+struct frame {
+	size_t		elem;
+	size_t		n;
+	size_t		i;
+	size_t		start;		// first op of the section body
+	unsigned long	stamp;
+};
+
+		/*
+		 * Reentrant rendering.
+		 *
+		 * A compiled program is never written to by the
+		 * mustache_render*() calls, so one program can be
+		 * shared by any number of threads, each rendering with
+		 * a mustache_ctx of its own.  A thread should keep its
+		 * context from one request to the next: it holds the
+		 * buffers, arena and caches a render needs, and reusing
+		 * it saves setting them up again.
+		 *
+		 * Nothing in the library is global; the older calls
+		 * below are reentrant too, except that render_compiled()
+		 * updates prog->sizehint.
+		 */
+
+struct mustache_ctx;
+
+struct mustache_ctx *mustache_ctx_new(void);
+
+void	mustache_ctx_free(struct mustache_ctx *ctx);
+
+int	mustache_render(struct mustache_ctx *ctx, const struct program *prog, char *json, const char **html, size_t *len);
+
+int	mustache_render_len(struct mustache_ctx *ctx, const struct program *prog, const char *json, size_t jsonlen, const char **html, size_t *len);
+
+int	mustache_render_to_sink(struct mustache_ctx *ctx, const struct program *prog, char *json, sink_write_fn write, void *arg);
+
+int	mustache_render_to_sink_len(struct mustache_ctx *ctx, const struct program *prog, const char *json, size_t jsonlen, sink_write_fn write, void *arg);
+
+int	mustache_render_to_fd(struct mustache_ctx *ctx, const struct program *prog, char *json, int fd);
+
+int	mustache_render_to_fd_len(struct mustache_ctx *ctx, const struct program *prog, const char *json, size_t jsonlen, int fd);
 
-struct jsonpair {
-	unsigned short	offset;
-	unsigned short length;
-	unsigned short valoffset;
-	unsigned short vallength;
-	enum jsontype type;
-	struct json children;
-	SLIST_ENTRY(jsonpair) link;
+// A file mapped read-only by map_file().
+struct mapfile {
+	const char	*p;
+	size_t		len;
 };
 
+int	map_file(const char *path, struct mapfile *m);
+
+void	unmap_file(struct mapfile *m);
+
+int	compile_file(const char *path, struct program **progp);
+
+int	render_file_to_fd(const struct program *prog, const char *json_path, int fd);
+
+int	mustache_render_file(struct mustache_ctx *ctx, const struct program *prog, const char *json_path, const char **html, size_t *len);
+
+		/*
+		 * A template cache holds compiled templates, keyed by
+		 * their text or their path, for any number of threads.
+		 * It keeps them within a budget of bytes, dropping the
+		 * least recently used first.
+		 */
+
+struct mustache_cache;
+
+struct mustache_cache_stats {
+	unsigned long	hits;
+	unsigned long	misses;		// each one a compile
+	unsigned long	evictions;
+	size_t		entries;
+	size_t		bytes;
+};
+
+struct mustache_cache *mustache_cache_new(size_t budget);
+
+void	mustache_cache_free(struct mustache_cache *c);
+
+void	mustache_cache_stats(struct mustache_cache *c, struct mustache_cache_stats *st);
+
+int	mustache_render_cached(struct mustache_ctx *ctx, struct mustache_cache *cache, const char *template, size_t templatelen, const char *json, size_t jsonlen, const char **html, size_t *len);
+
+int	mustache_render_cached_file(struct mustache_ctx *ctx, struct mustache_cache *cache, const char *template_path, const char *json, size_t jsonlen, const char **html, size_t *len);
+
+		/*
+		 * Every call that takes NUL-terminated text has a _len
+		 * twin taking (pointer, length) pairs instead, for
+		 * input such as network buffers that is not terminated.
+		 * The string versions call strlen() once and hand off.
+		 */
+
 int	render(const char* template, char *json, char **resultp);
 
-int	size_index(const char *json, size_t jsonlen, unsigned short **indexp, unsigned int *iszp);
+int	render_len(const char *template, size_t templatelen, const char *json, size_t jsonlen, char **resultp);
+
+int	compile_template(const char *template, struct program **progp);
+
+int	compile_template_len(const char *template, size_t len, struct program **progp);
+
+int	compile_template_partials(const char *template, size_t len, partial_fn load, void *arg, struct program **progp);
+
+int	render_compiled(struct program *prog, char *json, char **resultp);
+
+int	render_compiled_len(struct program *prog, const char *json, size_t jsonlen, char **resultp);
+
+int	render_to_sink(const struct program *prog, char *json, sink_write_fn write, void *arg);
+
+int	render_to_sink_len(const struct program *prog, const char *json, size_t jsonlen, sink_write_fn write, void *arg);
+
+int	render_to_fd(const struct program *prog, char *json, int fd);
+
+int	render_to_fd_len(const struct program *prog, const char *json, size_t jsonlen, int fd);
+
+int	render_measure(const struct program *prog, char *json, size_t *len);
+
+int	render_measure_len(const struct program *prog, const char *json, size_t jsonlen, size_t *len);
+
+int	render_into(const struct program *prog, char *json, char *html, size_t size, size_t *len);
+
+int	render_into_len(const struct program *prog, const char *json, size_t jsonlen, char *html, size_t size, size_t *len);
+
+scan_fn	find_special_kernel(void);
+
+int	escape_measure(scan_fn find, const char *s, size_t len, size_t *lenp);
+
+scan_fn	find_html_stop_kernel(void);
+
+int	buf_init(struct buf *b, size_t hint);
+
+int	buf_grow(struct buf *b, size_t len);
+
+int	buf_write(struct buf *b, const char *s, size_t len);
+
+void	*arena_alloc(struct arena *a, size_t n);
+
+void	arena_reset(struct arena *a);
+
+void	arena_free(struct arena *a);
+
+void	free_program(struct program *prog);
+
+int	size_index(const char *json, size_t jsonlen, struct jsonindex *ix);
+
+int	index_json(const char *json, size_t jsonlen, struct jsonindex *ix);
+
+size_t	index_at(const struct jsonindex *ix, size_t i);
+
+size_t	index_find(const char *json, const struct jsonindex *ix, const char *key, size_t keylen);
+
+void	free_index(struct jsonindex *ix);
+
+classify_fn	classify_kernel(void);
+
+int	index_structure(const char *json, size_t jsonlen, struct arena *arena, struct jsonstruct *s);
+
+int	parsedoc(const char *json, size_t jsonlen, struct arena *arena, struct jsondoc *doc);
+
+void	freedoc(struct jsondoc *doc);
+
+void	doc_root(const struct jsondoc *doc, struct jsonval *v);
+
+int	jsonval_path(const struct jsonval *obj, const char *key, struct jsonval *val);
+
+int	resolve_ctx(struct objcache *oc, const struct jsonval *ctx, int n, const char *key, struct span *v);
 
-int	index_json(const char *json, size_t jsonlen, unsigned short **indexp);
+int	resolve(const struct jsondoc *doc, char section[][MAX_KEYSZ], int sections_n, const char *key, struct span *v);
 
-int	parsejson(const char *json, size_t jsonlen, struct json *jp);
+int	getdoc(const struct jsondoc *doc, char section[][MAX_KEYSZ], int sections_n, const char *key, char **val);
 
 int	get(const char *json, size_t jsonlen, char section[][MAX_KEYSZ], int sectionidx, const char *key, char **val);
 
-int	jsonpath(const char *json, size_t jsonlen, const char *key, unsigned short *offset, unsigned short *length);
+int	jsonpath(const char *json, size_t jsonlen, const char *key, size_t *offset, size_t *length);
 
-void	trim(const char *json, unsigned short *offset, unsigned short *length);
+void	trim(const char *json, size_t *offset, size_t *length);
 
 
 
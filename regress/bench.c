@@ -0,0 +1,578 @@
+// Micro-benchmarks for the render, JSON lookup and escape paths.
+// @since Sat Oct 17 14:02:11 EDT 2026
+//
+// Every input is generated here, the same way each run, so numbers
+// from two builds can be compared.  Each benchmark is run for at
+// least BENCH_MIN_NS; the best of BENCH_ROUNDS rounds is reported
+// as ns per operation, input bytes per second, and the number of
+// malloc(), calloc() and realloc() calls made by the library per
+// operation.
+//
+// The library is compiled with those three renamed to the counting
+// versions below (see the bench target in the Makefile).
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+#include "../cmustache.h"
+
+#define BENCH_MIN_NS	200000000ULL
+#define BENCH_ROUNDS	3
+
+// Bumped from render threads too, so atomic.
+_Atomic size_t	allocs;
+
+void *
+bench_malloc(size_t n)
+{
+	allocs++;
+	return malloc(n);
+}
+
+void *
+bench_calloc(size_t n, size_t sz)
+{
+	allocs++;
+	return calloc(n, sz);
+}
+
+void *
+bench_realloc(void *p, size_t n)
+{
+	allocs++;
+	return realloc(p, n);
+}
+
+// One benchmark: fn(arg) is a single operation over bytes of input.
+struct bench {
+	const char	*name;
+	int		(*fn)(void *arg);
+	void		*arg;
+	size_t		bytes;
+};
+
+struct renderarg {
+	const char	*template;
+	char		*json;
+	struct program	*prog;
+	struct mustache_ctx *ctx;
+	struct mustache_cache *cache;
+	int		fd;
+};
+
+struct lookuparg {
+	const char	*json;
+	size_t		jsonlen;
+	const char	*key;
+};
+
+struct escapearg {
+	scan_fn		find;
+	char		*s;
+	size_t		len;
+};
+
+unsigned long long
+now()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Returns the best ns per operation.
+double
+run(const struct bench *b)
+{
+	unsigned long long	start, ns, best = 0;
+	size_t			n, iters = 1, a = 0;
+
+	// Warm up, and check that it works at all.
+	if (b->fn(b->arg))
+		errx(1, "%s: failed", b->name);
+
+	// Double the iteration count until a round takes long enough.
+	for (;;) {
+		start = now();
+		for (n = 0; n < iters; n++)
+			b->fn(b->arg);
+		if (now() - start >= BENCH_MIN_NS)
+			break;
+		iters *= 2;
+	}
+
+	for (int r = 0; r < BENCH_ROUNDS; r++) {
+		a = allocs;
+		start = now();
+		for (n = 0; n < iters; n++)
+			b->fn(b->arg);
+		ns = now() - start;
+		a = allocs - a;
+		if (!best || ns < best)
+			best = ns;
+	}
+
+	printf("%-28s %12.1f ns/op %10.1f MB/s %8.1f allocs/op\n",
+		b->name,
+		(double) best / iters,
+		(double) b->bytes * iters / best * 1000.0,
+		(double) a / iters);
+
+	return (double) best / iters;
+}
+
+int
+do_render(void *arg)
+{
+	struct renderarg *r = arg;
+	char		*html = 0;
+	int		rval = 0;
+
+	rval = render(r->template, r->json, &html);
+	free(html);
+
+	return rval;
+}
+
+int
+do_render_compiled(void *arg)
+{
+	struct renderarg *r = arg;
+	char		*html = 0;
+	int		rval = 0;
+
+	rval = render_compiled(r->prog, r->json, &html);
+	free(html);
+
+	return rval;
+}
+
+// Measure, then render into a buffer of exactly that size.
+int
+do_render_measured(void *arg)
+{
+	struct renderarg *r = arg;
+	char		*html = 0;
+	size_t		len = 0;
+	int		rval = 0;
+
+	rval = render_measure(r->prog, r->json, &len);
+
+	if (!rval && (html = malloc(len + 1)) == NULL)
+		rval = ENOMEM;
+
+	if (!rval)
+		rval = render_into(r->prog, r->json, html, len, &len);
+
+	free(html);
+
+	return rval;
+}
+
+int
+do_render_measure(void *arg)
+{
+	struct renderarg *r = arg;
+	size_t		len = 0;
+
+	return render_measure(r->prog, r->json, &len);
+}
+
+int
+do_render_to_fd(void *arg)
+{
+	struct renderarg *r = arg;
+
+	return render_to_fd(r->prog, r->json, r->fd);
+}
+
+int
+do_mustache_render(void *arg)
+{
+	struct renderarg *r = arg;
+	const char	*html = 0;
+
+	return mustache_render(r->ctx, r->prog, r->json, &html, 0);
+}
+
+int
+do_mustache_render_cached(void *arg)
+{
+	struct renderarg *r = arg;
+	const char	*html = 0;
+
+	return mustache_render_cached(r->ctx, r->cache, r->template, strlen(r->template),
+		r->json, strlen(r->json), &html, 0);
+}
+
+int
+do_escape(void *arg)
+{
+	struct escapearg *e = arg;
+	size_t		len = 0;
+
+	return escape_measure(e->find, e->s, e->len, &len);
+}
+
+int
+do_jsonpath(void *arg)
+{
+	struct lookuparg *l = arg;
+	size_t		offset = 0;
+	size_t		length = 0;
+
+	return jsonpath(l->json, l->jsonlen, l->key, &offset, &length);
+}
+
+int
+do_parsedoc(void *arg)
+{
+	struct lookuparg *l = arg;
+	struct jsondoc	doc = {0};
+	int		rval = 0;
+
+	rval = parsedoc(l->json, l->jsonlen, 0, &doc);
+	freedoc(&doc);
+
+	return rval;
+}
+
+int
+do_get(void *arg)
+{
+	struct lookuparg *l = arg;
+	char		section[][MAX_KEYSZ] = { { "obj" }, { 0 } };
+	char		*val = 0;
+	int		rval = 0;
+
+	rval = get(l->json, l->jsonlen, section, 1, l->key, &val);
+	free(val);
+
+	return rval;
+}
+
+// Append to a growing string.
+char *
+cat(char *s, size_t *len, const char *t)
+{
+	size_t		n = strlen(t);
+
+	if ((s = realloc(s, *len + n + 1)) == NULL)
+		err(1, "realloc");
+	memcpy(s + *len, t, n + 1);
+	*len += n;
+
+	return s;
+}
+
+// About n bytes of HTML with a handful of tags.
+char *
+literal_heavy(size_t n)
+{
+	char		*s = 0;
+	size_t		len = 0;
+
+	s = cat(s, &len, "<html><head><title>{{title}}</title></head><body>\n");
+	while (len < n)
+		s = cat(s, &len, "<p class=\"copy\">Lorem ipsum dolor sit amet, "
+			"consectetur adipiscing elit, sed do eiusmod tempor.</p>\n");
+	s = cat(s, &len, "<footer>{{footer}}</footer></body></html>\n");
+
+	return s;
+}
+
+// n tags with almost nothing between them.
+char *
+tag_dense(size_t n)
+{
+	const char	*tags[] = { "{{a}}", "{{b}}", "{{{c}}}", "{{d.e}}" };
+	char		*s = 0;
+	size_t		len = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		s = cat(s, &len, tags[i % 4]);
+		s = cat(s, &len, " ");
+	}
+
+	return s;
+}
+
+// Sections s0 through s<depth-1>, each inside the last,
+// with a value looked up at every level.
+char *
+nested(int depth)
+{
+	char		tag[64];
+	char		*s = 0;
+	size_t		len = 0;
+
+	for (int i = 0; i < depth; i++) {
+		snprintf(tag, sizeof(tag), "{{#s%d}}<li>{{v}}\n", i);
+		s = cat(s, &len, tag);
+	}
+	for (int i = depth - 1; i >= 0; i--) {
+		snprintf(tag, sizeof(tag), "</li>{{/s%d}}\n", i);
+		s = cat(s, &len, tag);
+	}
+
+	return s;
+}
+
+char *
+nested_json(int depth)
+{
+	char		buf[64];
+	char		*s = 0;
+	size_t		len = 0;
+
+	for (int i = 0; i < depth; i++) {
+		snprintf(buf, sizeof(buf), "{\"v\": \"level %d\", \"s%d\": ", i, i);
+		s = cat(s, &len, buf);
+	}
+	s = cat(s, &len, "true");
+	for (int i = 0; i < depth; i++)
+		s = cat(s, &len, "}");
+
+	return s;
+}
+
+// A context of about n bytes: filler members, then an
+// object holding the key being looked up, so a lookup has to
+// get past everything else first.
+char *
+context(size_t n)
+{
+	char		buf[64];
+	char		*s = 0;
+	size_t		len = 0;
+
+	s = cat(s, &len, "{");
+	for (size_t i = 0; len < n; i++) {
+		snprintf(buf, sizeof(buf), "\"filler%07zu\": \"%012zu\", ", i, i);
+		s = cat(s, &len, buf);
+	}
+	s = cat(s, &len, "\"obj\": {\"target\": \"found it\"}}");
+
+	return s;
+}
+
+// An n byte value; every tenth byte needs escaping if dirty is set.
+char *
+escape_value(size_t n, int dirty)
+{
+	char		*s = 0;
+
+	if ((s = malloc(n + 1)) == NULL)
+		err(1, "malloc");
+	for (size_t i = 0; i < n; i++)
+		s[i] = dirty && i % 10 == 9 ? "<>&"[i / 10 % 3] : 'a' + i % 26;
+	s[n] = 0;
+
+	return s;
+}
+
+void
+bench_render(const char *name, const char *template, char *json)
+{
+	struct renderarg r = {template, json, 0, 0, 0};
+	struct bench	b = {0};
+	char		full[64];
+
+	if (compile_template(template, &r.prog))
+		errx(1, "%s: does not compile", name);
+
+	b.arg = &r;
+	b.bytes = strlen(template) + strlen(json);
+
+	snprintf(full, sizeof(full), "render/%s", name);
+	b.name = full;
+	b.fn = do_render;
+	run(&b);
+
+	snprintf(full, sizeof(full), "render_compiled/%s", name);
+	b.fn = do_render_compiled;
+	run(&b);
+
+	snprintf(full, sizeof(full), "render_measured/%s", name);
+	b.fn = do_render_measured;
+	run(&b);
+
+	snprintf(full, sizeof(full), "mustache_render/%s", name);
+	b.fn = do_mustache_render;
+	r.ctx = mustache_ctx_new();
+	run(&b);
+
+	snprintf(full, sizeof(full), "mustache_render_cached/%s", name);
+	b.fn = do_mustache_render_cached;
+	r.cache = mustache_cache_new(0);
+	run(&b);
+	mustache_cache_free(r.cache);
+	mustache_ctx_free(r.ctx);
+
+	free_program(r.prog);
+}
+
+// One list section over n rows, serially and split across threads.
+// One big list rendered on 1, 2, 4 ... threads, up to 16 or the
+// number of CPUs if that is more, into each kind of output: a
+// buffer (which copies every chunk), /dev/null (which does not),
+// and a count.  Each line also gives the speedup over one thread,
+// which only means something on a machine with that many cores.
+void
+bench_rows(size_t n)
+{
+	static const struct {
+		const char	*name;
+		int		(*fn)(void *arg);
+	} outs[] = {
+		{ "buf", do_render_compiled },
+		{ "fd", do_render_to_fd },
+		{ "count", do_render_measure },
+	};
+	struct renderarg r = {0};
+	struct bench	b = {0};
+	char		full[64];
+	char		*json = 0;
+	size_t		len = 0;
+	char		row[96];
+	long		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int		max = cpus > 16 ? cpus : 16;
+	double		one = 0, ns = 0;
+
+	json = cat(json, &len, "{\"rows\": [");
+	for (size_t i = 0; i < n; i++) {
+		snprintf(row, sizeof(row), "%s{\"id\": %zu, \"name\": \"row <%zu>\"}",
+			i ? "," : "", i, i);
+		json = cat(json, &len, row);
+	}
+	json = cat(json, &len, "]}");
+
+	r.template = "<table>{{#rows}}<tr><td>{{id}}</td><td>{{name}}</td></tr>\n{{/rows}}</table>";
+	r.json = json;
+	if (compile_template(r.template, &r.prog))
+		errx(1, "rows: does not compile");
+	if ((r.fd = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "/dev/null");
+
+	b.name = full;
+	b.arg = &r;
+	b.bytes = len;
+
+	printf("rows: %ld cpus\n", cpus);
+	for (size_t o = 0; o < sizeof(outs) / sizeof(*outs); o++) {
+		b.fn = outs[o].fn;
+		for (int threads = 1; threads <= max; threads *= 2) {
+			r.prog->threads = threads;
+			snprintf(full, sizeof(full), "rows/%zu/%s/threads=%d", n, outs[o].name, threads);
+			ns = run(&b);
+			if (threads == 1)
+				one = ns;
+			printf("%-28s %12.2fx over 1 thread\n", "", one / ns);
+		}
+	}
+
+	close(r.fd);
+	free_program(r.prog);
+	free(json);
+}
+
+void
+bench_lookup(size_t n)
+{
+	struct lookuparg l = {0};
+	struct bench	b = {0};
+	char		full[64];
+	char		*json = context(n);
+
+	l.json = json;
+	l.jsonlen = strlen(json);
+	b.arg = &l;
+	b.bytes = l.jsonlen;
+
+	snprintf(full, sizeof(full), "jsonpath/%zuKB", n / 1024);
+	l.key = "obj.target";
+	b.name = full;
+	b.fn = do_jsonpath;
+	run(&b);
+
+	snprintf(full, sizeof(full), "parsedoc/%zuKB", n / 1024);
+	b.fn = do_parsedoc;
+	run(&b);
+
+	snprintf(full, sizeof(full), "get/%zuKB", n / 1024);
+	l.key = "target";
+	b.fn = do_get;
+	run(&b);
+
+	free(json);
+}
+
+// escape_to() alone, into a count sink, over one value the size
+// of a typical tag's: no JSON and no render around it.
+void
+bench_escape(size_t n, int dirty)
+{
+	struct escapearg e = {0};
+	struct bench	b = {0};
+	char		full[64];
+
+	e.find = find_special_kernel();
+	e.s = escape_value(n, dirty);
+	e.len = n;
+
+	snprintf(full, sizeof(full), "escape/%s/%zu", dirty ? "dirty" : "clean", n);
+	b.name = full;
+	b.fn = do_escape;
+	b.arg = &e;
+	b.bytes = n;
+	run(&b);
+
+	free(e.s);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char		*t, *j;
+
+	t = literal_heavy(64 * 1024);
+	j = "{\"title\": \"Benchmarks\", \"footer\": \"&copy; 2026\"}";
+	bench_render("literal-heavy", t, j);
+	free(t);
+
+	t = tag_dense(4096);
+	j = "{\"a\": \"alpha\", \"b\": 42, \"c\": \"<b>raw</b>\", \"d\": {\"e\": \"deep\"}}";
+	bench_render("tag-dense", t, j);
+	free(t);
+
+	t = nested(MAX_SECTION_DEPTH - 1);
+	j = nested_json(MAX_SECTION_DEPTH - 1);
+	bench_render("nested", t, j);
+	free(t);
+	free(j);
+
+	bench_rows(50000);
+
+	for (size_t n = 1024; n <= 16 * 1024 * 1024; n *= 8)
+		bench_lookup(n);
+
+	for (int dirty = 0; dirty <= 1; dirty++) {
+		bench_escape(50, dirty);
+		bench_escape(100, dirty);
+		bench_escape(200, dirty);
+		bench_escape(500, dirty);
+	}
+
+	return 0;
+}
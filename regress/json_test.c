@@ -6,6 +6,8 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sysexits.h>
@@ -13,8 +15,6 @@
 #include "deps/vec/vec.h"
 
 
-#include "j0g.h"
-#include "js0n.h"
 #include "queue.h"
 #include "tap.h"
 
@@ -24,8 +24,8 @@ void
 test_trim()
 {
 	char	*s = "     a     ";
-	unsigned short	offset = 0;
-	unsigned short length = strlen(s);
+	size_t		offset = 0;
+	size_t		length = strlen(s);
 
 	trim(s, &offset, &length);
 
@@ -39,8 +39,8 @@ jsonpath_trim()
 {
 	char		*json = "{\"a\": \"   b   \"}";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), "a", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -96,8 +96,8 @@ jsonpath_nodot()
 {
 	char		*json = "{\"a\": {\"one\": 1}, \"b\": {\"two\": 2}}";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), "a", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -110,8 +110,8 @@ jsonpath_drilldown1()
 {
 	char		*json = "{\"a\": {\"one\": 1}, \"b\": {\"two\": 2}}";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), "a.one", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -124,8 +124,8 @@ jsonpath_drilldown2()
 {
 	char		*json = "{\"a\": {\"one\": {\"two\": \"abcdefg\" }, \"b\": {\"two\": 2} } }";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), "a.one.two", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -138,8 +138,8 @@ jsonpath_fail_lookup()
 {
 	char		*json = "{\"a\": {\"one\": {\"two\": \"abcdefg\" }, \"b\": {\"two\": 2} } }";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), "a.one.two.three", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -160,8 +160,8 @@ void
 jsonpath_null_json()
 {
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(0, 10, "a.one.two.three", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -174,8 +174,8 @@ jsonpath_null_key()
 {
 	char		*json = "{\"a\": {\"one\": {\"two\": \"abcdefg\" }, \"b\": {\"two\": 2} } }";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), 0, &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -188,8 +188,8 @@ jsonpath_key_with_dot()
 {
 	char		*json = "{\"a\": {\"one.two\": 1}, \"b\": {\"two\": 2}}";
 	int		rval = 0;
-	unsigned short offset;
-	unsigned short length;
+	size_t		offset;
+	size_t		length;
 
 	rval = jsonpath(json, strlen(json), "a.one.two", &offset, &length);
 	ok(!rval, "rval is %d", rval);
@@ -200,101 +200,377 @@ jsonpath_key_with_dot()
 void
 parsejson1()
 {
-	struct json j = {0};
+	struct jsondoc	doc = {0};
 	char	*json = "{\"a\": 1}";
-	struct jsonpair *jp = 0;
 	int	rval = 0;
-	int	n = 0;
 
-	rval = parsejson(json, strlen(json), &j);
+	rval = parsedoc(json, strlen(json), 0, &doc);
 	ok(!rval, "rval is %d", rval);
 
-	SLIST_FOREACH(jp, &j, link)
-		n++;
-	cmp_ok(n, "==", 1);
+	cmp_ok(doc.n, "==", 2);
+	cmp_ok(doc.members[0], "==", 1);
+	cmp_ok(doc.type[1], "==", number_type);
 
-	jp = SLIST_FIRST(&j);
-	cmp_ok(jp->type, "==", number_type);
+	freedoc(&doc);
 }
 
 void
 parsejsontypes()
 {
-	struct json j = {0};
+	struct jsondoc	doc = {0};
 	char	*json = "{\"a\": 1, \"b\": {}, \"c\": [], \"d\": \"s\", \"e\":false, \"f\":true, \"g\":null}";
-	struct jsonpair *jp = 0;
-	enum jsontype exp[] = {null_type, true_type, false_type, string_type, array_type, object_type, number_type};
+	enum jsontype exp[] = {number_type, object_type, array_type, string_type, false_type, true_type, null_type};
 	int	rval = 0;
 	int	n = 0;
 
-	rval = parsejson(json, strlen(json), &j);
+	rval = parsedoc(json, strlen(json), 0, &doc);
 	ok(!rval, "rval is %d", rval);
 
-	SLIST_FOREACH(jp, &j, link) {
-		cmp_ok(jp->type, "==", exp[n]);
+	for (size_t i = 1; i < doc.next[0]; i = doc.next[i]) {
+		cmp_ok(doc.type[i], "==", exp[n]);
 		n++;
 	}
+	cmp_ok(n, "==", 7);
+
+	freedoc(&doc);
 }
 
-struct jsonpair *
-getpair(const struct json *j, int idx)
+// The tape entry of the idx'th child of entry parent.
+size_t
+getpair(const struct jsondoc *doc, size_t parent, int idx)
 {
-	struct jsonpair *jp = 0;
+	size_t		i = parent + 1;
 
-	jp = SLIST_FIRST(j);
-	for (int i = 0; jp && i < idx; i++)
-		jp = SLIST_NEXT(jp, link);
+	for (int k = 0; i < doc->next[parent] && k < idx; k++)
+		i = doc->next[i];
 
-	return jp;
+	return i;
 }
 	
 
 void
 parsejsontree()
 {
-	struct json j = {0};
+	struct jsondoc	doc = {0};
 	char	*json = "{\"a\": {\"a0\": 1, \"a1\": 2}, \"b\": { \"b0\": [1,2,3,4], \"b1\": null}, \"c\": true}";
-	struct jsonpair *jp = 0;
+	size_t		i = 0;
 	int rval = 0;
-	unsigned short offset = 0;
 
-	rval = parsejson(json, strlen(json), &j);
+	rval = parsedoc(json, strlen(json), 0, &doc);
 	ok(!rval, "rval is %d", rval);
 
-	jp = getpair(&j, 1);
-	offset = jp->valoffset;
-	jp = getpair(&jp->children, 1);
-	ok(!memcmp("b0", json + offset + jp->offset, jp->length)) 
-		|| diag("Got %.2s, not b0", json + offset + jp->offset);
-	ok(!strncmp("[1,2,3,4]", json + offset + jp->valoffset, jp->vallength))
-		|| diag("Got %.10s, not [1,2,3,4]", json + offset + jp->valoffset);
-	cmp_ok(jp->type, "==", array_type);
+	i = getpair(&doc, 0, 1);
+	i = getpair(&doc, i, 0);
+	ok(!memcmp("b0", json + doc.key[i], doc.keylen[i])) 
+		|| diag("Got %.2s, not b0", json + doc.key[i]);
+	ok(!strncmp("[1,2,3,4]", json + doc.val[i], doc.vallen[i]))
+		|| diag("Got %.10s, not [1,2,3,4]", json + doc.val[i]);
+	cmp_ok(doc.type[i], "==", array_type);
+	cmp_ok(doc.members[i], "==", 4);
+
+	freedoc(&doc);
 }
 
 void
 parsearraywithobj()
 {
-	struct json j = {0};
+	struct jsondoc	doc = {0};
 	char	*json = "{\"a\": [1,{\"b\":null},3,4] }";
-	struct jsonpair *jp = 0;
+	size_t		i = 0;
 	int rval = 0;
-	unsigned short offset = 0;
 
-	rval = parsejson(json, strlen(json), &j);
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	ok(!rval, "rval is %d", rval);
+
+	i = getpair(&doc, 0, 0);
+	i = getpair(&doc, i, 1);
+	i = getpair(&doc, i, 0);
+
+	ok(!memcmp("b", json + doc.key[i], doc.keylen[i])) 
+		|| diag("Got %.1s, not b", json + doc.key[i]);
+
+	cmp_ok(doc.type[i], "==", null_type);
+
+	freedoc(&doc);
+}
+
+// A malformed context fails to parse, and leaves nothing to free.
+void
+parsedoc_errors()
+{
+	const char	*bad[] = { "{\"a\" 1}", "{\"a\": [1, 2}", "[1,,2]", "{\"a\": \"b", "{1: 2}" };
+	struct jsondoc	doc = {0};
+	int		rval = 0;
+
+	for (size_t i = 0; i < sizeof(bad) / sizeof(*bad); i++) {
+		rval = parsedoc(bad[i], strlen(bad[i]), 0, &doc);
+		cmp_ok(rval, "==", EX_JSON_PARSE_ERROR, "%s", bad[i]);
+		cmp_ok(doc.n, "==", 0);
+	}
+}
+
+// Nesting deeper than the C stack could recurse.
+void
+parsedoc_deep()
+{
+	struct jsondoc	doc = {0};
+	struct jsonval	root = {0};
+	struct jsonval	v = {0};
+	size_t		depth = 100000;
+	char		*json = 0;
+	char		*html = 0;
+	char		*p = 0;
+	int		rval = 0;
+
+	p = json = calloc(2 * depth + 32, 1);
+	p += sprintf(p, "{\"a\":1,\"b\":");
+	memset(p, '[', depth);
+	memset(p + depth, ']', depth);
+	strcat(p, "}");
+
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	ok(!rval, "rval is %d", rval);
+	// The root, a, and b's arrays.
+	cmp_ok(doc.n, "==", depth + 2);
+	cmp_ok(doc.next[0], "==", depth + 2);
+	cmp_ok(doc.members[2], "==", 1);
+	cmp_ok(doc.members[depth + 1], "==", 0);
+
+	doc_root(&doc, &root);
+	ok(jsonval_path(&root, "a", &v));
+	ok(!strncmp(v.p, "1", v.doc->vallen[v.i]));
+	freedoc(&doc);
+
+	rval = render("{{a}}", json, &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "1");
+	free(html);
+
+	// Unclosed, it is still an error.
+	json[strlen(json) - 2] = 0;
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	cmp_ok(rval, "==", EX_JSON_PARSE_ERROR);
+
+	free(json);
+}
+
+void
+parsedoc_path()
+{
+	struct jsondoc	doc = {0};
+	struct jsonval	root = {0};
+	struct jsonval	v = {0};
+	char		*json = "{\"a\": {\"one\": {\"two\": \"abcdefg\" }, \"b\": {\"two\": 2} } }";
+	int		rval = 0;
+
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	ok(!rval, "rval is %d", rval);
+
+	doc_root(&doc, &root);
+
+	ok(jsonval_path(&root, "a.one.two", &v));
+	cmp_ok(v.p - json, "==", 23);
+	cmp_ok(v.doc->vallen[v.i], "==", 7);
+	cmp_ok(v.doc->type[v.i], "==", string_type);
+
+	ok(jsonval_path(&root, "a.b.two", &v));
+	ok(!strncmp(v.p, "2", v.doc->vallen[v.i]));
+
+	ok(!jsonval_path(&root, "a.one.two.three", &v));
+	ok(!jsonval_path(&root, "", &v));
+
+	freedoc(&doc);
+}
+
+void
+parsedoc_types()
+{
+	struct jsondoc	doc = {0};
+	struct jsonval	root = {0};
+	struct jsonval	v = {0};
+	char		*json = "{\"s\": \"false\", \"f\": false, \"o\": \"{x}\"}";
+	int		rval = 0;
+
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	ok(!rval, "rval is %d", rval);
+
+	doc_root(&doc, &root);
+
+	ok(jsonval_path(&root, "s", &v));
+	cmp_ok(v.doc->type[v.i], "==", string_type);
+	ok(jsonval_path(&root, "f", &v));
+	cmp_ok(v.doc->type[v.i], "==", false_type);
+	ok(jsonval_path(&root, "o", &v));
+	cmp_ok(v.doc->type[v.i], "==", string_type);
+
+	freedoc(&doc);
+}
+
+void
+getdoc_section()
+{
+	char		 section[][MAX_KEYSZ] = { { "a" }, { 0 } };
+	struct jsondoc	doc = {0};
+	char		*val = 0;
+	char		*json = "{\"a\": {\"one\": 1}, \"b\": {\"two\": 2}, \"three\": \" 3 \"}";
+	int		rval = 0;
+
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	ok(!rval, "rval is %d", rval);
+
+	rval = getdoc(&doc, section, 1, "one", &val);
+	ok(!rval, "rval is %d", rval);
+	is(val, "1");
+	free(val);
+
+	// Not in a, so found by peeling off a.
+	rval = getdoc(&doc, section, 1, "three", &val);
+	ok(!rval, "rval is %d", rval);
+	is(val, "3");
+	free(val);
+
+	rval = getdoc(&doc, section, 1, "two", &val);
+	ok(!rval, "rval is %d", rval);
+	ok(val == 0);
+
+	freedoc(&doc);
+}
+
+// A flat object with n members, "k0": 0 through "k<n-1>": <n-1>.
+char *
+bigobject(size_t n)
+{
+	char		*json = 0;
+	char		*p = 0;
+
+	p = json = calloc(n * 24 + 2, 1);
+	*p++ = '{';
+	for (size_t i = 0; i < n; i++)
+		p += sprintf(p, "%s\"k%zu\": %zu", i ? ", " : "", i, i);
+	*p++ = '}';
+
+	return json;
+}
+
+void
+index_width()
+{
+	struct jsonindex ix = {0};
+	char		*small = "{\"a\": 1}";
+	char		*big = bigobject(10000);
+	int		rval = 0;
+
+	rval = index_json(small, strlen(small), &ix);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(ix.width, "==", 2);
+	cmp_ok(index_at(&ix, 2), "==", 6);
+	free_index(&ix);
+
+	rval = index_json(big, strlen(big), &ix);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(ix.width, "==", 4);
+	cmp_ok(index_find(big, &ix, "k9999", 5), "==", 9999 * 4 + 2);
+	free_index(&ix);
+
+	free(big);
+}
+
+void
+jsonpath_past_64k()
+{
+	struct jsondoc	doc = {0};
+	struct jsonval	root = {0};
+	struct jsonval	v = {0};
+	char		*json = bigobject(10000);
+	size_t		offset = 0;
+	size_t		length = 0;
+	int		rval = 0;
+
+	ok(strlen(json) > USHRT_MAX);
+
+	rval = jsonpath(json, strlen(json), "k9999", &offset, &length);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(offset, ">", USHRT_MAX);
+	ok(!strncmp(json + offset, "9999", length));
+
+	rval = parsedoc(json, strlen(json), 0, &doc);
+	ok(!rval, "rval is %d", rval);
+	doc_root(&doc, &root);
+	ok(jsonval_path(&root, "k9998", &v));
+	ok(!strncmp(v.p, "9998", v.doc->vallen[v.i]));
+	freedoc(&doc);
+
+	free(json);
+}
+
+// A document parsed into an arena needs no freedoc(), and takes
+// two allocations (the structural bitmap and the tape), however
+// many members it has.
+void
+parsedoc_arena()
+{
+	struct arena	arena = {0};
+	struct jsondoc	doc = {0};
+	struct jsonval	root = {0};
+	struct jsonval	v = {0};
+	char		*json = bigobject(10000);
+	int		rval = 0;
+
+	rval = parsedoc(json, strlen(json), &arena, &doc);
 	ok(!rval, "rval is %d", rval);
+	doc_root(&doc, &root);
+	ok(jsonval_path(&root, "k4321", &v));
+	ok(!strncmp(v.p, "4321", v.doc->vallen[v.i]));
+	cmp_ok(doc.n, "==", 10001);
+	cmp_ok(arena.allocs, "==", 2);
 
-	jp = getpair(&j, 0);
-	offset = jp->valoffset;
+	arena_free(&arena);
+	ok(arena.head == 0);
 
-	jp = getpair(&jp->children, 2);
-	offset += jp->valoffset;
+	free(json);
+}
 
-	jp = getpair(&jp->children, 0);
+// Brackets, colons, commas and escaped quotes inside strings are
+// not structural, wherever the 64 byte blocks fall.
+void
+index_structure_strings()
+{
+	struct jsonstruct s = {0};
+	struct jsondoc	doc = {0};
+	struct jsonval	root = {0};
+	struct jsonval	v = {0};
+	char		json[256];
+	int		rval = 0;
 
-	ok(!memcmp("b", json + offset + jp->offset, jp->length)) 
-		|| diag("Got %.1s, not b", json + offset + jp->offset);
+	for (int pad = 0; pad < 64; pad++) {
+		snprintf(json, sizeof(json), "{\"%*s\": 1, \"s\": \"[{:,}] \\\\\\\" \\\\\", \"t\": [true]}",
+			pad + 1, "x");
+
+		rval = index_structure(json, strlen(json), 0, &s);
+		if (rval || s.seps != 4)
+			break;
+		free(s.bits);
+
+		rval = parsedoc(json, strlen(json), 0, &doc);
+		if (rval)
+			break;
+		doc_root(&doc, &root);
+		if (!jsonval_path(&root, "t", &v) || strncmp(v.p, "[true]", v.doc->vallen[v.i]))
+			rval = -1;
+		if (!jsonval_path(&root, "s", &v) || v.doc->vallen[v.i] != 14)
+			rval = -1;
+		freedoc(&doc);
+		if (rval)
+			break;
+	}
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(s.seps, "==", 4);
 
-	cmp_ok(jp->type, "==", null_type);
+	// The closing quote is escaped.
+	snprintf(json, sizeof(json), "{\"a\": \"b\\\"}");
+	rval = index_structure(json, strlen(json), 0, &s);
+	cmp_ok(rval, "==", EX_JSON_PARSE_ERROR);
+	free(s.bits);
 }
 
 int
@@ -314,12 +590,22 @@ main (int argc, char *argv[])
 	test_trim();
 
 	resolve_section();
-
+*/
 	parsejson1();
 	parsejsontypes();
 	parsejsontree();
-*/
 	parsearraywithobj();
+	parsedoc_errors();
+	parsedoc_deep();
+	index_structure_strings();
+
+	parsedoc_path();
+	parsedoc_types();
+	getdoc_section();
+
+	index_width();
+	jsonpath_past_64k();
+	parsedoc_arena();
 	
 	done_testing();
 }
@@ -0,0 +1,1204 @@
+// Unit test template compilation and rendering.
+// @since Sat Oct 17 09:12:40 EDT 2026
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "tap.h"
+
+#include "../cmustache.h"
+
+void
+compile_ops()
+{
+	struct program	*prog = 0;
+	char		*template = "<p>{{a}} {{{b}}}{{&c}}{{#d}}x{{/d}}</p>";
+	enum opcode	exp[] = {op_literal, op_escaped, op_literal, op_raw,
+				op_raw, op_push, op_literal, op_pop, op_literal};
+	int		rval = 0;
+
+	rval = compile_template(template, &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(prog->ops_n, "==", sizeof(exp) / sizeof(exp[0]));
+
+	for (size_t i = 0; i < prog->ops_n; i++)
+		cmp_ok(prog->ops[i].code, "==", exp[i]);
+
+	ok(!strncmp(prog->text + prog->ops[0].offset, "<p>", prog->ops[0].length));
+	is(prog->text + prog->ops[4].offset, "c");
+
+	free_program(prog);
+}
+
+void
+compile_merges_literals()
+{
+	struct program	*prog = 0;
+	char		*template = "a { b } c";
+	int		rval = 0;
+
+	rval = compile_template(template, &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(prog->ops_n, "==", 1);
+	cmp_ok(prog->ops[0].length, "==", strlen(template));
+
+	free_program(prog);
+}
+
+void
+compile_unbalanced()
+{
+	struct program	*prog = 0;
+	int		rval = 0;
+
+	rval = compile_template("{{#a}}{{/b}}", &prog);
+	cmp_ok(rval, "==", EX_POP_DOES_NOT_MATCH);
+	ok(prog == 0);
+
+	rval = compile_template("{{/a}}", &prog);
+	cmp_ok(rval, "==", EX_POP_DOES_NOT_MATCH);
+
+	rval = compile_template("{{^a}}{{/b}}", &prog);
+	cmp_ok(rval, "==", EX_POP_DOES_NOT_MATCH);
+}
+
+void
+render_compiled_twice()
+{
+	struct program	*prog = 0;
+	char		*html = 0;
+	int		rval = 0;
+
+	rval = compile_template("Hi {{#p}}{{name}}{{/p}}!", &prog);
+	ok(!rval, "rval is %d", rval);
+
+	rval = render_compiled(prog, "{\"p\": {\"name\": \"Joe\"}}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "Hi Joe!");
+	free(html);
+
+	rval = render_compiled(prog, "{\"p\": {\"name\": \"<Al>\"}}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "Hi &lt;Al&gt;!");
+	free(html);
+
+	free_program(prog);
+}
+
+void
+render_large_page()
+{
+	struct program	*prog = 0;
+	char		*template = 0;
+	char		*html = 0;
+	size_t		n = 5000;
+	int		rval = 0;
+
+	// 5000 x "{{v}}-" renders 35,000 bytes, well past one BUFSZ_DELTA.
+	template = calloc(n * 6 + 1, 1);
+	for (size_t i = 0; i < n; i++)
+		strcat(template + i * 6, "{{v}}-");
+
+	rval = compile_template(template, &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(prog->sizehint, "==", 0);
+
+	rval = render_compiled(prog, "{\"v\": \"<>\"}", &html);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(strlen(html), "==", n * 9);
+	ok(!strncmp(html, "&lt;&gt;-&lt;&gt;-", 18));
+	cmp_ok(prog->sizehint, "==", n * 9);
+	free(html);
+
+	free_program(prog);
+	free(template);
+}
+
+void
+buf_grows()
+{
+	struct buf	b = {0};
+	int		rval = 0;
+
+	rval = buf_init(&b, 0);
+	ok(!rval, "rval is %d", rval);
+
+	for (int i = 0; !rval && i < 100000; i++)
+		rval = buf_write(&b, "abc", 3);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(b.len, "==", 300000);
+	cmp_ok(b.sz, ">", b.len);
+	cmp_ok(b.data[b.len], "==", 0);
+
+	free(b.data);
+}
+
+void
+compile_memo_slots()
+{
+	struct program	*prog = 0;
+	char		*html = 0;
+	int		rval = 0;
+
+	rval = compile_template("{{#a}}{{x}}{{x}}{{/a}}{{x}}{{#a}}{{&x}}{{/a}}", &prog);
+	ok(!rval, "rval is %d", rval);
+
+	// x under a, x at the top, and a itself.
+	cmp_ok(prog->slots_n, "==", 3);
+	cmp_ok(prog->ops[0].slot, "==", prog->ops[5].slot);
+	cmp_ok(prog->ops[1].slot, "==", prog->ops[2].slot);
+	cmp_ok(prog->ops[1].slot, "==", prog->ops[6].slot);
+	cmp_ok(prog->ops[1].slot, "!=", prog->ops[4].slot);
+
+	rval = render_compiled(prog, "{\"a\": {\"x\": 1}, \"x\": 2}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "1121");
+	free(html);
+
+	rval = render_compiled(prog, "{\"a\": {}, \"x\": 2}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "2222");
+	free(html);
+
+	free_program(prog);
+}
+
+void
+compile_section_jumps()
+{
+	struct program	*prog = 0;
+	char		*html = 0;
+	int		rval = 0;
+
+	rval = compile_template("{{#a}}x{{#b}}y{{/b}}{{/a}}{{^c}}z{{/c}}", &prog);
+	ok(!rval, "rval is %d", rval);
+
+	// Each section's open knows its pop.
+	cmp_ok(prog->ops[0].jump, "==", 5);
+	cmp_ok(prog->ops[2].jump, "==", 4);
+	cmp_ok(prog->ops[6].jump, "==", 8);
+
+	rval = render_compiled(prog, "{\"a\": {\"b\": false}, \"c\": 1}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "x");
+	free(html);
+
+	free_program(prog);
+
+	// One left open runs to the end.
+	rval = compile_template("{{#a}}x", &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(prog->ops[0].jump, "==", prog->ops_n);
+
+	rval = render_compiled(prog, "{\"a\": false}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "");
+	free(html);
+
+	free_program(prog);
+}
+
+void
+render_escapes()
+{
+	char		*html = 0;
+	int		rval = 0;
+
+	rval = render("{{a}}|{{{a}}}", "{\"a\": \"<a href='x'>&amp;\\\"</a>\"}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "&lt;a href='x'&gt;&amp;amp;\\&quot;&lt;/a&gt;|<a href='x'>&amp;\\\"</a>");
+	free(html);
+}
+
+void
+render_lists()
+{
+	char		*html = 0;
+	char		*json = 0;
+	char		*p = 0;
+	size_t		n = 10000;
+	int		rval = 0;
+
+	// Each element in order, with outer names still visible.
+	rval = render("{{#items}}<li>{{name}}/{{shop}}</li>{{/items}}",
+		"{\"shop\": \"s\", \"items\": [{\"name\": \"a\"}, "
+		"{\"name\": \"b\"}, {\"name\": \"c\", \"shop\": \"t\"}]}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<li>a/s</li><li>b/s</li><li>c/t</li>");
+	free(html);
+
+	// An empty list is falsey, along with everything inside it.
+	rval = render("[{{#l}}x{{#m}}y{{/m}}{{/l}}]", "{\"l\": [], \"m\": true}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "[]");
+	free(html);
+
+	rval = render("{{#l}}({{.}}){{/l}}", "{\"l\": [1, \"two\", 3]}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "(1)(two)(3)");
+	free(html);
+
+	// Lists in lists.
+	rval = render("{{#r}}{{#c}}{{.}}{{/c}};{{/r}}",
+		"{\"r\": [{\"c\": [1, 2]}, {\"c\": [3]}, {\"c\": [4, 5, 6]}]}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "12;3;456;");
+	free(html);
+
+	// A big table.
+	p = json = calloc(n * 16 + 16, 1);
+	p += sprintf(p, "{\"rows\": [");
+	for (size_t i = 0; i < n; i++)
+		p += sprintf(p, "%s{\"v\": %zu}", i ? "," : "", i % 10);
+	sprintf(p, "]}");
+
+	rval = render("{{#rows}}{{v}}{{/rows}}", json, &html);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(strlen(html), "==", n);
+	ok(!strncmp(html, "0123456789012", 13));
+	free(html);
+	free(json);
+}
+
+void
+render_inverted()
+{
+	struct program	*prog = 0;
+	char		*html = 0;
+	int		rval = 0;
+	const char	*t = "{{#x}}[{{.}}]{{/x}}{{^x}}none{{/x}}";
+	char		*cases[][2] = {
+		{"{}", "none"},
+		{"{\"x\": false}", "none"},
+		{"{\"x\": null}", "none"},
+		{"{\"x\": []}", "none"},
+		{"{\"x\": true}", "[true]"},
+		{"{\"x\": \"\"}", "[]"},
+		{"{\"x\": [1, 2]}", "[1][2]"},
+	};
+
+	rval = compile_template(t, &prog);
+	ok(!rval, "rval is %d", rval);
+
+	// Both sections on x share one lookup.
+	cmp_ok(prog->ops[0].code, "==", op_push);
+	cmp_ok(prog->ops[5].code, "==", op_invert);
+	cmp_ok(prog->ops[0].slot, "==", prog->ops[5].slot);
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		rval = render_compiled(prog, cases[i][0], &html);
+		ok(!rval, "rval is %d", rval);
+		is(html, cases[i][1], "%s", cases[i][0]);
+		free(html);
+	}
+
+	free_program(prog);
+
+	// The body is in the parent's context, once, even under a list.
+	rval = render("{{#l}}{{^done}}{{n}} {{/done}}{{/l}}",
+		"{\"l\": [{\"n\": 1}, {\"n\": 2, \"done\": true}, {\"n\": 3}]}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "1 3 ");
+	free(html);
+
+	// Nested in a false section, it is dropped with it.
+	rval = render("[{{#f}}{{^g}}x{{/g}}{{/f}}]", "{\"f\": false}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "[]");
+	free(html);
+}
+
+// Big lists split across threads render exactly as they do serially.
+void
+render_lists_parallel()
+{
+	struct program	*prog = 0;
+	char		*template = "<h1>{{title}}</h1>{{#rows}}<tr>{{#cells}}<td>{{.}}{{title}}</td>{{/cells}}"
+				"{{#off}}never{{/off}}</tr>{{/rows}}{{#rows}}{{/rows}}.";
+	char		*json = 0;
+	char		*serial = 0;
+	char		*html = 0;
+	char		*p = 0;
+	FILE		*fp = 0;
+	size_t		n = 5000;
+	size_t		len = 0;
+	int		rval = 0;
+
+	p = json = calloc(n * 64 + 64, 1);
+	p += sprintf(p, "{\"title\": \"<t>\", \"off\": false, \"rows\": [");
+	for (size_t i = 0; i < n; i++)
+		p += sprintf(p, "%s{\"cells\": [%zu, \"x\", %zu]}", i ? "," : "", i, i * 7);
+	sprintf(p, "]}");
+
+	rval = compile_template(template, &prog);
+	ok(!rval, "rval is %d", rval);
+
+	rval = render_compiled(prog, json, &serial);
+	ok(!rval, "rval is %d", rval);
+
+	prog->threads = 8;
+	rval = render_compiled(prog, json, &html);
+	ok(!rval, "rval is %d", rval);
+	ok(!strcmp(html, serial));
+	ok(strstr(html, "<td>4999&lt;t&gt;</td>") != 0);
+	free(html);
+
+	// An fd sink points straight into the chunk buffers.
+	fp = tmpfile();
+	rval = render_to_fd(prog, json, fileno(fp));
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(ftell(fp), "==", strlen(serial));
+	rewind(fp);
+	html = calloc(strlen(serial) + 1, 1);
+	ok(fread(html, 1, strlen(serial), fp) == strlen(serial));
+	ok(!strcmp(html, serial));
+	free(html);
+	fclose(fp);
+
+	// Chunks only count for a count sink.
+	rval = render_measure(prog, json, &len);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(len, "==", strlen(serial));
+
+	free(serial);
+	free_program(prog);
+	free(json);
+}
+
+// Lookups in a wide object give the same answers once it is hashed.
+void
+render_wide_object()
+{
+	char		*template = 0;
+	char		*json = 0;
+	char		*want = 0;
+	char		*html = 0;
+	char		*t, *j, *w;
+	size_t		n = 2000;
+	int		rval = 0;
+
+	t = template = calloc(n * 48 + 64, 1);
+	j = json = calloc(n * 48 + 64, 1);
+	w = want = calloc(n * 48 + 64, 1);
+
+	j += sprintf(j, "{\"dup\": \"first\"");
+	for (size_t i = 0; i < n; i++) {
+		j += sprintf(j, ", \"sku%zu\": \"v%zu\"", i, i * 3);
+		t += sprintf(t, "{{sku%zu}}{{dup}}{{nope%zu}},", i, i);
+		w += sprintf(w, "v%zulast,", i * 3);
+	}
+	sprintf(j, ", \"dup\": \"last\"}");
+
+	rval = render(template, json, &html);
+	ok(!rval, "rval is %d", rval);
+	ok(!strcmp(html, want));
+
+	free(html);
+	free(template);
+	free(json);
+	free(want);
+}
+
+// Nothing reads past the lengths it is given.
+void
+render_unterminated()
+{
+	const char	*t = "<{{a}}>{{#l}}{{.}}{{/l}}";
+	const char	*j = "{\"a\": \"<\", \"l\": [\"x\", \"y\"]}";
+	char		*template = malloc(strlen(t));
+	char		*json = malloc(strlen(j));
+	char		*html = 0;
+	int		rval = 0;
+
+	// Exactly sized, with no room for a NUL.
+	memcpy(template, t, strlen(t));
+	memcpy(json, j, strlen(j));
+
+	rval = render_len(template, strlen(t), json, strlen(j), &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<&lt;>xy");
+	free(html);
+
+	// Just a prefix of the template.
+	rval = render_len(template, 7, json, strlen(j), &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<&lt;>");
+	free(html);
+
+	free(template);
+	free(json);
+}
+
+// Write s to a new temporary file and return its name.
+char *
+tmpwrite(const char *s)
+{
+	char		*path = strdup("/tmp/render_test.XXXXXX");
+	int		fd = mkstemp(path);
+
+	if (fd < 0 || write(fd, s, strlen(s)) != (ssize_t) strlen(s))
+		err(EX_IOERR, "can't write %s", path);
+	close(fd);
+
+	return path;
+}
+
+// Templates and contexts from mapped files, by length, with no NUL.
+void
+render_from_files()
+{
+	struct mustache_ctx *ctx = mustache_ctx_new();
+	struct program	*prog = 0;
+	struct mapfile	m = {0};
+	const char	*html = 0;
+	char		*tpath = tmpwrite("<{{a}}>{{#l}}{{.}}{{/l}}");
+	char		*jpath = tmpwrite("{\"a\": \"x&y\", \"l\": [1, 2]}");
+	char		*epath = tmpwrite("");
+	char		got[64] = {0};
+	size_t		len = 0;
+	FILE		*fp = 0;
+	int		rval = 0;
+
+	rval = map_file(tpath, &m);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(m.len, "==", 24);
+	unmap_file(&m);
+
+	ok(map_file("/nonexistent/template", &m) == ENOENT);
+
+	rval = map_file(epath, &m);
+	ok(!rval && m.len == 0);
+	unmap_file(&m);
+
+	// Only the first len bytes count.
+	rval = compile_template_len("{{a}}{{b}}", 5, &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(prog->ops_n, "==", 1);
+	free_program(prog);
+
+	rval = compile_file(tpath, &prog);
+	ok(!rval, "rval is %d", rval);
+
+	rval = mustache_render_file(ctx, prog, jpath, &html, &len);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<x&amp;y>12");
+	cmp_ok(len, "==", 11);
+
+	rval = mustache_render_file(ctx, prog, epath, &html, &len);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<>");
+
+	fp = tmpfile();
+	rval = render_file_to_fd(prog, jpath, fileno(fp));
+	ok(!rval, "rval is %d", rval);
+	rewind(fp);
+	ok(fread(got, 1, sizeof(got) - 1, fp) == 11);
+	is(got, "<x&amp;y>12");
+	fclose(fp);
+
+	free_program(prog);
+	mustache_ctx_free(ctx);
+	unlink(tpath);
+	unlink(jpath);
+	unlink(epath);
+	free(tpath);
+	free(jpath);
+	free(epath);
+}
+
+// A template is compiled once per cache, and the least recently
+// used go when the budget is exceeded.
+void
+render_cached()
+{
+	struct mustache_ctx *ctx = mustache_ctx_new();
+	struct mustache_cache *cache = mustache_cache_new(0);
+	struct mustache_cache_stats st = {0};
+	struct mustache_cache_stats before = {0};
+	const char	*json = "{\"a\": \"<x>\"}";
+	const char	*html = 0;
+	char		big[5000];
+	char		t[32];
+	int		rval = 0;
+
+	for (int i = 0; i < 3; i++) {
+		rval = mustache_render_cached(ctx, cache, "[{{a}}]", 7, json, strlen(json), &html, 0);
+		ok(!rval, "rval is %d", rval);
+		is(html, "[&lt;x&gt;]");
+	}
+
+	// A different template, with the same start.
+	rval = mustache_render_cached(ctx, cache, "[{{a}}]{{{a}}}", 14, json, strlen(json), &html, 0);
+	ok(!rval, "rval is %d", rval);
+	is(html, "[&lt;x&gt;]<x>");
+
+	mustache_cache_stats(cache, &st);
+	cmp_ok(st.hits, "==", 2);
+	cmp_ok(st.misses, "==", 2);
+	cmp_ok(st.entries, "==", 2);
+	cmp_ok(st.evictions, "==", 0);
+
+	ok(mustache_render_cached(ctx, cache, "{{/a}}", 6, json, strlen(json), &html, 0)
+		== EX_POP_DOES_NOT_MATCH);
+
+	mustache_cache_free(cache);
+
+	// The template's text is kept once, at the start of the program's.
+	cache = mustache_cache_new(0);
+	memset(big, 'b', sizeof(big) - 1);
+	memcpy(big + 1000, "{{a}}", 5);
+	big[sizeof(big) - 1] = 0;
+	rval = mustache_render_cached(ctx, cache, big, strlen(big), json, strlen(json), &html, 0);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(strlen(html), "==", sizeof(big) - 1 - 5 + 9);
+	ok(!strncmp(html + 1000, "&lt;x&gt;bbb", 12));
+	rval = mustache_render_cached(ctx, cache, big, strlen(big), json, strlen(json), &html, 0);
+	ok(!rval, "rval is %d", rval);
+	mustache_cache_stats(cache, &before);
+	cmp_ok(before.hits, "==", 1);
+	cmp_ok(before.bytes, "<", sizeof(big) + 1024);
+
+	// An empty section tag is dropped, joining the literals around
+	// it into one that isn't in the template as it stands.
+	rval = mustache_render_cached(ctx, cache, "x{{#}}y{{a}}", 12, json, strlen(json), &html, 0);
+	ok(!rval, "rval is %d", rval);
+	is(html, "xy&lt;x&gt;");
+	mustache_cache_free(cache);
+
+	// Room for about three of these.
+	cache = mustache_cache_new(3 * st.bytes / 2);
+	for (int i = 0; i < 40; i++) {
+		snprintf(t, sizeof(t), "%d{{a}}", i % 8);
+		rval |= mustache_render_cached(ctx, cache, t, strlen(t), json, strlen(json), &html, 0);
+		rval |= strncmp(html, t, 1);
+	}
+	ok(!rval, "rval is %d", rval);
+
+	mustache_cache_stats(cache, &st);
+	cmp_ok(st.misses, "==", 40);
+	cmp_ok(st.entries, "<=", 3);
+	cmp_ok(st.evictions, "==", 40 - st.entries);
+
+	mustache_cache_free(cache);
+
+	// Small templates are charged for what they use, so a small
+	// budget still holds several.
+	cache = mustache_cache_new(4000);
+	for (int i = 0; i < 40; i++) {
+		snprintf(t, sizeof(t), "%d{{a}}", i % 8);
+		rval |= mustache_render_cached(ctx, cache, t, strlen(t), json, strlen(json), &html, 0);
+	}
+	ok(!rval, "rval is %d", rval);
+
+	mustache_cache_stats(cache, &st);
+	cmp_ok(st.misses, "==", 8);
+	cmp_ok(st.hits, "==", 32);
+	cmp_ok(st.evictions, "==", 0);
+	cmp_ok(st.bytes, "<=", 4000);
+
+	// Bigger than the whole budget: rendered, but not kept.
+	memset(big, 'b', sizeof(big) - 1);
+	big[sizeof(big) - 1] = 0;
+	rval = mustache_render_cached(ctx, cache, big, strlen(big), json, strlen(json), &html, 0);
+	ok(!rval, "rval is %d", rval);
+	is(html, big);
+
+	mustache_cache_stats(cache, &before);
+	cmp_ok(before.misses, "==", st.misses + 1);
+	cmp_ok(before.entries, "==", st.entries);
+	cmp_ok(before.bytes, "==", st.bytes);
+	cmp_ok(before.evictions, "==", 0);
+
+	// The ones that fit are still there.
+	rval = mustache_render_cached(ctx, cache, t, strlen(t), json, strlen(json), &html, 0);
+	ok(!rval, "rval is %d", rval);
+	is(html, "7&lt;x&gt;");
+	mustache_cache_stats(cache, &st);
+	cmp_ok(st.hits, "==", before.hits + 1);
+
+	mustache_cache_free(cache);
+	mustache_ctx_free(ctx);
+}
+
+struct cacheworker {
+	struct mustache_cache *cache;
+	int		fails;
+	pthread_t	tid;
+};
+
+void *
+render_cached_many(void *arg)
+{
+	struct cacheworker *w = arg;
+	struct mustache_ctx *ctx = mustache_ctx_new();
+	const char	*html = 0;
+	char		t[32];
+	char		want[32];
+
+	for (int i = 0; i < 500; i++) {
+		snprintf(t, sizeof(t), "%d:{{a}}", i % 16);
+		snprintf(want, sizeof(want), "%d:x", i % 16);
+		w->fails += mustache_render_cached(ctx, w->cache, t, strlen(t), "{\"a\": \"x\"}", 10, &html, 0)
+			|| strcmp(html, want);
+	}
+
+	mustache_ctx_free(ctx);
+
+	return 0;
+}
+
+// Threads sharing a cache too small for their templates,
+// so entries are evicted while others are rendering them.
+void
+render_cached_concurrently()
+{
+	struct mustache_cache_stats st = {0};
+	struct cacheworker w[4] = {{0}};
+	struct mustache_cache *cache = mustache_cache_new(40000);
+	int		fails = 0;
+
+	for (int i = 0; i < 4; i++) {
+		w[i].cache = cache;
+		pthread_create(&w[i].tid, 0, render_cached_many, w + i);
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(w[i].tid, 0);
+		fails += w[i].fails;
+	}
+	cmp_ok(fails, "==", 0);
+
+	mustache_cache_stats(cache, &st);
+	cmp_ok(st.hits + st.misses, "==", 2000);
+	cmp_ok(st.bytes, "<=", 40000);
+
+	mustache_cache_free(cache);
+}
+
+// A cached template file is recompiled when it changes.
+void
+render_cached_file()
+{
+	struct mustache_ctx *ctx = mustache_ctx_new();
+	struct mustache_cache *cache = mustache_cache_new(1 << 20);
+	struct mustache_cache_stats st = {0};
+	char		*tpath = tmpwrite("<{{a}}>");
+	const char	*html = 0;
+	FILE		*fp = 0;
+	int		rval = 0;
+
+	for (int i = 0; i < 2; i++) {
+		rval = mustache_render_cached_file(ctx, cache, tpath, "{\"a\": 1}", 9, &html, 0);
+		ok(!rval, "rval is %d", rval);
+		is(html, "<1>");
+	}
+
+	if ((fp = fopen(tpath, "w")) == NULL)
+		err(EX_IOERR, "can't write %s", tpath);
+	fputs("<<{{a}}>>", fp);
+	fclose(fp);
+
+	rval = mustache_render_cached_file(ctx, cache, tpath, "{\"a\": 1}", 9, &html, 0);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<<1>>");
+
+	mustache_cache_stats(cache, &st);
+	cmp_ok(st.hits, "==", 1);
+	cmp_ok(st.misses, "==", 2);
+	cmp_ok(st.entries, "==", 1);
+
+	ok(mustache_render_cached_file(ctx, cache, "/nonexistent/template", "{}", 2, &html, 0) == ENOENT);
+
+	unlink(tpath);
+	free(tpath);
+	mustache_cache_free(cache);
+	mustache_ctx_free(ctx);
+}
+
+// Partials for render_partials(), by name.
+const char *partials[][2] = {
+	{ "header",	"<h1>{{title}}</h1>" },
+	{ "item",	"<li>{{.}}</li>" },
+	{ "list",	"{{#items}}{{> item}}{{/items}}" },
+	{ "node",	"{{name}}{{#kids}}({{> node}}){{/kids}}" },
+	{ "loop",	"x{{> loop}}" },
+	{ "close",	"{{/a}}" },
+	{ "open",	"{{#a}}" },
+};
+
+int
+load_partial(void *arg, const char *name, const char **text, size_t *len)
+{
+	for (size_t i = 0; i < sizeof(partials) / sizeof(*partials); i++) {
+		if (!strcmp(partials[i][0], name)) {
+			*text = partials[i][1];
+			*len = strlen(*text);
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
+
+int
+count_ops(const struct program *prog, enum opcode code)
+{
+	int		n = 0;
+
+	for (size_t i = 0; i < prog->ops_n; i++)
+		n += prog->ops[i].code == code;
+
+	return n;
+}
+
+// Partials are inlined, except where they include themselves.
+void
+render_partials()
+{
+	struct program	*prog = 0;
+	char		*html = 0;
+	const char	*t = 0;
+	int		rval = 0;
+
+	t = "{{> header}}<ul>{{> list }}</ul>{{>missing}}";
+	rval = compile_template_partials(t, strlen(t), load_partial, 0, &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(count_ops(prog, op_call), "==", 0);
+	cmp_ok(count_ops(prog, op_return), "==", 0);
+
+	rval = render_compiled(prog, "{\"title\": \"T\", \"items\": [1, 2]}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<h1>T</h1><ul><li>1</li><li>2</li></ul>");
+	free(html);
+	free_program(prog);
+
+	// Without a loader, partials are left out.
+	rval = compile_template("a{{> header}}b", &prog);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(prog->ops_n, "==", 1);
+	free_program(prog);
+
+	t = "<{{> node}}>";
+	rval = compile_template_partials(t, strlen(t), load_partial, 0, &prog);
+	ok(!rval, "rval is %d", rval);
+	// Inlined once, then called from there and from its own body.
+	cmp_ok(count_ops(prog, op_call), "==", 2);
+	cmp_ok(count_ops(prog, op_return), "==", 2);
+
+	rval = render_compiled(prog, "{\"name\": \"a\", \"kids\": ["
+		"{\"name\": \"b\", \"kids\": [{\"name\": \"c\", \"kids\": []}]},"
+		"{\"name\": \"d\", \"kids\": false}]}", &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<a(b(c))(d)>");
+	free(html);
+	free_program(prog);
+
+	t = "{{> loop}}";
+	rval = compile_template_partials(t, strlen(t), load_partial, 0, &prog);
+	ok(!rval, "rval is %d", rval);
+	rval = render_compiled(prog, "{}", &html);
+	cmp_ok(rval, "==", EX_PARTIAL_TOO_DEEP);
+	free(html);
+	free_program(prog);
+
+	// A partial can't close its caller's sections, or leave its own open.
+	t = "{{#a}}{{> close}}";
+	rval = compile_template_partials(t, strlen(t), load_partial, 0, &prog);
+	cmp_ok(rval, "==", EX_POP_DOES_NOT_MATCH);
+
+	t = "{{> open}}{{/a}}";
+	rval = compile_template_partials(t, strlen(t), load_partial, 0, &prog);
+	cmp_ok(rval, "==", EX_POP_DOES_NOT_MATCH);
+}
+
+// A recursive partial called from a list split across threads.
+void
+render_partials_parallel()
+{
+	struct program	*prog = 0;
+	char		*json = 0;
+	char		*serial = 0;
+	char		*html = 0;
+	char		*p = 0;
+	const char	*t = "{{#rows}}{{> node}};{{/rows}}";
+	size_t		n = 600;
+	int		rval = 0;
+
+	p = json = calloc(n * 64 + 16, 1);
+	p += sprintf(p, "{\"rows\": [");
+	for (size_t i = 0; i < n; i++)
+		p += sprintf(p, "%s{\"name\": %zu, \"kids\": [{\"name\": \"k\", \"kids\": []}]}",
+			i ? "," : "", i);
+	sprintf(p, "]}");
+
+	rval = compile_template_partials(t, strlen(t), load_partial, 0, &prog);
+	ok(!rval, "rval is %d", rval);
+
+	rval = render_compiled(prog, json, &serial);
+	ok(!rval, "rval is %d", rval);
+	ok(!strncmp(serial, "0(k);1(k);", 10));
+
+	prog->threads = 4;
+	rval = render_compiled(prog, json, &html);
+	ok(!rval, "rval is %d", rval);
+	is(html, serial);
+
+	free(html);
+	free(serial);
+	free(json);
+	free_program(prog);
+}
+
+// A context can be reused, and its page lasts until the next render.
+void
+render_with_ctx()
+{
+	struct mustache_ctx *ctx = mustache_ctx_new();
+	struct program	*prog = 0;
+	const char	*html = 0;
+	size_t		len = 0;
+	int		rval = 0;
+
+	rval = compile_template("{{#l}}<{{.}}>{{/l}}{{x}}", &prog);
+	ok(!rval, "rval is %d", rval);
+
+	rval = mustache_render(ctx, prog, "{\"l\": [1, 2], \"x\": \"&\"}", &html, &len);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<1><2>&amp;");
+	cmp_ok(len, "==", 11);
+
+	rval = mustache_render(ctx, prog, "{\"l\": [3], \"x\": \"y\"}", &html, &len);
+	ok(!rval, "rval is %d", rval);
+	is(html, "<3>y");
+	cmp_ok(len, "==", 4);
+
+	cmp_ok(mustache_render(ctx, 0, "{}", &html, &len), "==", EX_LOGIC_ERROR);
+
+	free_program(prog);
+	mustache_ctx_free(ctx);
+}
+
+struct worker {
+	const struct program *prog;
+	char		*json;
+	const char	*want;
+	int		fails;
+	pthread_t	tid;
+};
+
+void *
+render_many(void *arg)
+{
+	struct worker	*w = arg;
+	struct mustache_ctx *ctx = mustache_ctx_new();
+	const char	*html = 0;
+
+	for (int i = 0; i < 200; i++)
+		w->fails += mustache_render(ctx, w->prog, w->json, &html, 0) || strcmp(html, w->want);
+
+	mustache_ctx_free(ctx);
+
+	return 0;
+}
+
+// Threads share one program, each with its own context.
+void
+render_concurrently()
+{
+	struct program	*prog = 0;
+	struct worker	w[4] = {{0}};
+	char		*json[] = { "{\"a\": \"0\", \"l\": [1]}", "{\"a\": \"1\", \"l\": []}",
+				"{\"a\": \"<2>\", \"l\": [1, 2, 3]}", "{\"l\": [{\"a\": \"x\"}]}" };
+	char		*want[] = { "0[0]", "1", "&lt;2&gt;[&lt;2&gt;][&lt;2&gt;][&lt;2&gt;]", "[x]" };
+	int		fails = 0;
+
+	ok(!compile_template("{{a}}{{#l}}[{{a}}]{{/l}}", &prog));
+
+	for (int i = 0; i < 4; i++) {
+		w[i].prog = prog;
+		w[i].json = json[i];
+		w[i].want = want[i];
+		pthread_create(&w[i].tid, 0, render_many, w + i);
+	}
+	for (int i = 0; i < 4; i++) {
+		pthread_join(w[i].tid, 0);
+		fails += w[i].fails;
+	}
+	cmp_ok(fails, "==", 0);
+
+	free_program(prog);
+}
+
+void
+escape_scan()
+{
+	scan_fn		find = find_special_kernel();
+	char		buf[100];
+	const char	*specials = "&\"<>";
+	int		fails = 0;
+
+	// Near misses: '$' '\'' '=' '?', and '>' with the high bit set.
+	memset(buf, 'a', sizeof(buf));
+	memcpy(buf + 40, "$'=?\xbe\xa6", 6);
+	ok(find(buf, buf + sizeof(buf)) == buf + sizeof(buf));
+
+	// Every special, at every offset, on both sides of each vector width.
+	for (size_t n = 0; n < sizeof(buf); n++) {
+		for (size_t k = 0; k < n; k++) {
+			for (const char *c = specials; *c; c++) {
+				memset(buf, 'a', sizeof(buf));
+				buf[k] = *c;
+				fails += find(buf, buf + n) != buf + k;
+			}
+		}
+		memset(buf, 'a', sizeof(buf));
+		fails += find(buf, buf + n) != buf + n;
+	}
+	cmp_ok(fails, "==", 0);
+}
+
+// The HTML scanner stops at '{' and at bad control bytes only.
+void
+html_scan()
+{
+	scan_fn		find = find_html_stop_kernel();
+	char		buf[100];
+	const char	*stops = "{\x01\x0b\x1f";
+	int		fails = 0;
+
+	// Tabs, newlines and carriage returns are fine; so are '}' and 'z',
+	// and NULs, as badchar() has it.
+	memset(buf, 'a', sizeof(buf));
+	memcpy(buf + 40, "\t\n\r}z\xfb\0", 7);
+	ok(find(buf, buf + sizeof(buf)) == buf + sizeof(buf));
+
+	for (size_t n = 0; n < sizeof(buf); n++) {
+		for (size_t k = 0; k < n; k++) {
+			for (const char *c = stops; *c; c++) {
+				memset(buf, 'a', sizeof(buf));
+				buf[k] = *c;
+				fails += find(buf, buf + n) != buf + k;
+			}
+		}
+	}
+	cmp_ok(fails, "==", 0);
+}
+
+// A bad byte deep inside a long literal is still rejected.
+void
+compile_long_literal()
+{
+	struct program	*prog = 0;
+	char		t[200];
+
+	memset(t, 'x', sizeof(t) - 1);
+	t[sizeof(t) - 1] = 0;
+	cmp_ok(compile_template(t, &prog), "==", 0);
+	cmp_ok(prog->ops_n, "==", 1);
+	cmp_ok(prog->ops[0].length, "==", sizeof(t) - 1);
+	free_program(prog);
+
+	// A NUL is literal text, in the block the scanners take at once.
+	t[100] = 0;
+	cmp_ok(compile_template_len(t, sizeof(t) - 1, &prog), "==", 0);
+	cmp_ok(prog->ops_n, "==", 1);
+	cmp_ok(prog->ops[0].length, "==", sizeof(t) - 1);
+	free_program(prog);
+	t[100] = 'x';
+
+	t[150] = '\x02';
+	cmp_ok(compile_template(t, &prog), "==", EX_INVALID_CHAR);
+}
+
+// A sink that appends to a struct buf and counts calls.
+struct collect {
+	struct buf	b;
+	int		calls;
+};
+
+int
+collect(void *arg, const char *s, size_t len)
+{
+	struct collect	*c = arg;
+
+	c->calls++;
+	return buf_write(&c->b, s, len);
+}
+
+int
+refuse(void *arg, const char *s, size_t len)
+{
+	return 42;
+}
+
+void
+render_to_callback()
+{
+	struct program	*prog = 0;
+	struct collect	c = {{0}};
+	int		rval = 0;
+
+	rval = compile_template("<b>{{a}}</b>{{{a}}}.", &prog);
+	ok(!rval, "rval is %d", rval);
+
+	buf_init(&c.b, 0);
+	rval = render_to_sink(prog, "{\"a\": \"x&y\"}", collect, &c);
+	ok(!rval, "rval is %d", rval);
+	is(c.b.data, "<b>x&amp;y</b>x&y.");
+	// The escaped value goes out as "x", "&amp;", "y".
+	cmp_ok(c.calls, "==", 7);
+	free(c.b.data);
+
+	rval = render_to_sink(prog, "{\"a\": 1}", refuse, 0);
+	cmp_ok(rval, "==", 42);
+
+	free_program(prog);
+}
+
+void
+render_measured()
+{
+	struct program	*prog = 0;
+	char		*json = 0;
+	char		*want = 0;
+	char		*html = 0;
+	char		*p = 0;
+	size_t		n = 5000;
+	size_t		len = 0;
+	size_t		got = 0;
+	int		rval = 0;
+
+	rval = compile_template("<p>{{a}}|{{{a}}}{{^none}}!{{/none}}</p>"
+		"{{#rows}}<td>{{v}}</td>{{/rows}}", &prog);
+	ok(!rval, "rval is %d", rval);
+
+	// Enough rows to go across threads.
+	p = json = calloc(n * 16 + 64, 1);
+	p += sprintf(p, "{\"a\": \"<x & \\\"y\\\">\", \"rows\": [");
+	for (size_t i = 0; i < n; i++)
+		p += sprintf(p, "%s{\"v\": \"%c\"}", i ? "," : "", i % 7 ? 'v' : '&');
+	sprintf(p, "]}");
+	prog->threads = 4;
+
+	rval = render_compiled(prog, json, &want);
+	ok(!rval, "rval is %d", rval);
+
+	// The length counts what escaping adds.
+	rval = render_measure(prog, json, &len);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(len, "==", strlen(want));
+
+	html = malloc(len);
+	rval = render_into(prog, json, html, len, &got);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(got, "==", len);
+	ok(!memcmp(html, want, len));
+
+	// One byte short.
+	rval = render_into(prog, json, html, len - 1, &got);
+	cmp_ok(rval, "==", EX_OUTPUT_TOO_LONG);
+	cmp_ok(got, "<=", len - 1);
+
+	rval = render_measure(prog, "{}", &len);
+	ok(!rval, "rval is %d", rval);
+	cmp_ok(len, "==", strlen("<p>|!</p>"));
+
+	free(html);
+	free(want);
+	free(json);
+	free_program(prog);
+}
+
+void
+render_to_file()
+{
+	struct program	*prog = 0;
+	char		*template = 0;
+	char		*json = 0;
+	char		*html = 0;
+	char		*got = 0;
+	FILE		*fp = 0;
+	size_t		n = 500;
+	size_t		vlen = 20000;
+	long		sz = 0;
+	int		rval = 0;
+
+	// More spans than one writev() batch, and a big value.
+	template = calloc(n * 8 + sizeof("{{big}}"), 1);
+	for (size_t i = 0; i < n; i++)
+		strcat(template + i * 8, "({{a}})\n");
+	strcat(template, "{{big}}");
+
+	json = calloc(vlen + 32, 1);
+	strcpy(json, "{\"a\": \"<\", \"big\": \"");
+	memset(json + strlen(json), 'z', vlen);
+	strcat(json, "\"}");
+
+	rval = compile_template(template, &prog);
+	ok(!rval, "rval is %d", rval);
+
+	rval = render_compiled(prog, json, &html);
+	ok(!rval, "rval is %d", rval);
+
+	fp = tmpfile();
+	rval = render_to_fd(prog, json, fileno(fp));
+	ok(!rval, "rval is %d", rval);
+
+	sz = ftell(fp);
+	cmp_ok(sz, "==", strlen(html));
+	rewind(fp);
+	got = calloc(sz + 1, 1);
+	fread(got, 1, sz, fp);
+	is(got, html);
+
+	fclose(fp);
+	free(got);
+	free(html);
+	free(json);
+	free(template);
+	free_program(prog);
+}
+
+int
+main (int argc, char *argv[])
+{
+	compile_ops();
+	compile_merges_literals();
+	compile_unbalanced();
+	render_compiled_twice();
+	compile_memo_slots();
+	compile_section_jumps();
+	render_escapes();
+	render_lists();
+	render_inverted();
+	render_lists_parallel();
+	render_wide_object();
+	render_unterminated();
+	render_from_files();
+	render_with_ctx();
+	render_concurrently();
+	render_cached();
+	render_cached_file();
+	render_cached_concurrently();
+	render_partials();
+	render_partials_parallel();
+	escape_scan();
+	html_scan();
+	compile_long_literal();
+	render_large_page();
+	buf_grows();
+	render_to_callback();
+	render_measured();
+	render_to_file();
+
+	done_testing();
+}
@@ -5,14 +5,15 @@
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sysexits.h>
 
 #include "deps/vec/vec.h"
 
-#include "j0g.h"
-#include "js0n.h"
+#include "queue.h"
 #include "tap.h"
 
 #include "../cmustache.h"
@@ -20,73 +21,16 @@
 #include "spec_test.h"
 
 
-long
-filesize( const char *filename, FILE *fp)
-{
-	long		rval;
-
-	if (fseek(fp, 0, SEEK_END) != 0)
-		err(errno, "Can't seek to end of %s", filename);
-
-	rval = ftell(fp);
-
-	if (fseek(fp, 0L, SEEK_SET) != 0)
-		err(errno, "Can't seek back to beginning of %s", filename);
-
-	return rval;
-}
-
-char *
-ftos(const char *filename)
-{
-	char		*json;
-	long		sz;
-	FILE		*fp;
-
-	if ((fp = fopen(filename, "r")) == NULL)
-		err(EX_NOINPUT, "Can't read %s", filename);
-
-	sz = filesize(filename, fp);
-
-		/*
-		 * js0n stores offset's as unsigned shorts, so we can
-		 * only handle files with that many bytes.
-		 */
-
-	if (sz > USHRT_MAX)
-		errx(EX_DATAERR, "JSON file is larger than %d", USHRT_MAX);
-
-	if ((json = calloc(sz, 1)) == NULL)
-		err(ENOMEM, "Can't allocate %lu bytes", sz);
-
-	if (fread(json, 1, sz, fp) < sz)
-		err(errno, "Error reading %s", filename);
-
-	fclose(fp);
-
-	if (json[sz - 1] != 0) {
-		char *json2 = calloc(sz + 1, 1);
-		if (!json2)
-			err(ENOMEM, "Can't allocate %lu bytes", sz + 1);
-		memcpy(json2, json, sz);
-		free(json);
-		json2[sz] = 0;
-		json = json2;
-	}
-
-	return json;
-}
-
 struct test *
-get_test(char *tests, unsigned short *index)
+get_test(char *tests, const struct jsonindex *index, size_t i)
 {
 	struct test *rval = 0;
 	char *testjson = 0;
-	unsigned short	offset = 0;
-	unsigned short	length = 0;
+	size_t	offset = 0;
+	size_t	length = 0;
 
-	offset = *index;
-	length = *(index + 1);
+	offset = index_at(index, i);
+	length = index_at(index, i + 1);
 
 	tests[offset + length] = 0;
 	testjson = tests + offset;
@@ -120,16 +64,16 @@ get_test(char *tests, unsigned short *index)
 }
 
 test_vec_t
-parse_tests(char *json)
+parse_tests(const char *json, size_t jsonlen)
 {
 	test_vec_t tests_vec;
-	unsigned short	*index = 0;
+	struct jsonindex index = {0};
 	char *tests = 0;
 	int rval = 0;
 
 	vec_init(&tests_vec);
 
-	rval = get(json, strlen(json), 0, 0, "tests", &tests);
+	rval = get(json, jsonlen, 0, 0, "tests", &tests);
 
 	if (rval)
 		errx(rval, "Failed to parse test JSON, get returned error %d", rval);
@@ -139,10 +83,10 @@ parse_tests(char *json)
 
 	index_json(tests, strlen(tests), &index);
 
-	for (unsigned short *i = index; *i; i += 2)
-		vec_push(&tests_vec, get_test(tests, i));
+	for (size_t i = 0; index.v && index_at(&index, i); i += 2)
+		vec_push(&tests_vec, get_test(tests, &index, i));
 
-	free(index);
+	free_index(&index);
 
 	return tests_vec;
 
@@ -153,13 +97,14 @@ test_vec_t
 get_tests(const char *spec_file)
 {
 	test_vec_t	rval;
-	char 			*json = NULL;
+	struct mapfile	m = {0};
 
-	json = ftos(spec_file);
+	if ((errno = map_file(spec_file, &m)) != 0)
+		err(EX_NOINPUT, "Can't read %s", spec_file);
 
-	rval = parse_tests(json);
+	rval = parse_tests(m.p, m.len);
 
-	free(json);
+	unmap_file(&m);
 
 	return rval;
 }